@@ -2,68 +2,68 @@ package main
 
 import (
 	"bytes"
-	"encoding/json"
+	"encoding/binary"
 	"errors"
 	"fmt"
-	"html"
 	"net/http"
+	"strconv"
 	"strings"
-	"time"
+	"sync"
 
 	"github.com/gin-gonic/gin"
+	"github.com/gin-gonic/gin/binding"
 )
 
 // send the game servers stored to the client minimised or binary format
-func ShowServersMinimised(c *gin.Context) {
+func ShowServersMinimised(w http.ResponseWriter, r *http.Request) {
 
-	form, err := parseShowServersMinimisedForm(c)
+	form, err := parseShowServersMinimisedForm(r.URL.RawQuery)
 
 	if err != nil {
-		c.AbortWithStatusJSON(http.StatusBadRequest,
+		writeJSON(w, http.StatusBadRequest,
 			gin.H{
 				"success": false, "message": err.Error()})
 
 		return
 	}
 
-	ServerSliceClient, _ := txGameServerGetBy(form.Platform, form.Appkey, form.Pagesize, form.Offset)
+	snap := REGISTRY.Snapshot()
+	payload := VIEWCACHE.Get(snap.generation, form)
 
-	if len(ServerSliceClient) == 0 {
-		c.AbortWithStatusJSON(http.StatusNotFound,
-			gin.H{"success": false,
-				"message": "No servers available for " + form.Platform})
+	if payload == nil {
+		payload = renderView(snap, form)
+		VIEWCACHE.Put(form, payload)
+	}
 
+	if payload.status == http.StatusOK && notModified(w, r, payload.etag) {
 		return
 	}
 
-	var ServerMinSlice []GameServerMin
+	writeData(w, payload.status, payload.contentType, payload.body)
+}
 
-	for _, server := range ServerSliceClient {
-		ServerMinSlice = append(ServerMinSlice, server.Minimize())
-	}
+// next is the cursor for the following page, sent only to clients paginating
+// with after=: its length goes in the 2 reserved bytes of the header (little
+// endian, 0 if there are no more pages) and the cursor itself after the servers.
+func SerializeToBinaryFormat(serverList []GameServerMin, form ShowServersMinimisedFormData, next string) ([]byte, error) {
 
-	if form.Bin == 1 {
-		data := SerializeToBinaryFormat(c, ServerMinSlice, form)
-		c.Data(http.StatusOK, "application/octet-stream", data)
-	} else {
-		c.JSON(http.StatusOK, ServerMinSlice)
+	if len(form.After) == 0 {
+		next = ""
 	}
-}
 
-func SerializeToBinaryFormat(c *gin.Context, serverList []GameServerMin, form ShowServersMinimisedFormData) []byte {
+	if len(next) > 0xFFFF {
+		return nil, fmt.Errorf("next page cursor of %d bytes doesn't fit in the binary format", len(next))
+	}
 
-	var buf []byte
+	buf := make([]byte, 0, 3+len(serverList)*BINARY_SERVER_SIZE+len(next))
 	buf = append(buf, byte(len(serverList)))
-
-	// Reserved for future use
-	buf = append(buf, byte(0))
-	buf = append(buf, byte(0))
+	buf = binary.LittleEndian.AppendUint16(buf, uint16(len(next)))
 
 	for _, server := range serverList {
 		buf = server.appendAsBinary(buf)
 	}
 
-	return buf
+	return append(buf, next...), nil
 }
 
 type ShowServersMinimisedFormData struct {
@@ -71,22 +71,23 @@ type ShowServersMinimisedFormData struct {
 	Appkey   int    // -1 if none
 	Pagesize int    // number of entries to return.
 	Offset   int    // offset of the entries
+	After    string // keyset cursor of the entries, CURSOR_FIRST for the first page, "" if none (page/offset pagination)
 	Bin      int    // 1 if client expects binary response instead of json
 }
 
-func parseShowServersMinimisedForm(c *gin.Context) (output ShowServersMinimisedFormData, err error) {
+func parseShowServersMinimisedForm(rawQuery string) (output ShowServersMinimisedFormData, err error) {
 
-	platform := c.Query("platform")
+	platform := queryValue(rawQuery, "platform")
 
 	if len(platform) == 0 {
 		return output, fmt.Errorf("you need to submit a platform")
 	}
 
 	// optional field. If appkey is empty, it becomes a None (-1)
-	appkeyForm := c.Query("appkey")
+	appkeyForm := queryValue(rawQuery, "appkey")
 	appkey := Atoi(appkeyForm, -1)
 
-	pagesizeForm := c.Query("pagesize")
+	pagesizeForm := queryValue(rawQuery, "pagesize")
 	pagesize := 255 // big number so in case it's not in the form, the select gets all the records
 	offset := 0
 
@@ -94,55 +95,64 @@ func parseShowServersMinimisedForm(c *gin.Context) (output ShowServersMinimisedF
 	if len(pagesizeForm) > 0 {
 		pagesize = Atoi(pagesizeForm, 6)
 
-		pageForm := c.Query("page")
+		pageForm := queryValue(rawQuery, "page")
 		if len(pageForm) > 0 {
 			offset = pagesize * Atoi(pageForm, 0)
 		}
 
-		offsetForm := c.Query("offset")
+		offsetForm := queryValue(rawQuery, "offset")
 		if len(offsetForm) > 0 {
 			offset = Atoi(offsetForm, 0)
 		}
 	}
 
+	// cursor pagination takes precedence over page/offset
+	after := queryValue(rawQuery, "after")
+	if len(after) > 0 {
+
+		if _, err := decodeCursor(after); err != nil {
+			return output, err
+		}
+
+		offset = 0
+	}
+
 	return ShowServersMinimisedFormData{
 		Platform: platform,
 		Appkey:   appkey,
 		Pagesize: pagesize,
 		Offset:   offset,
-		Bin:      IfElse(c.Query("bin") == "1", 1, 0),
+		After:    after,
+		Bin:      IfElse(queryValue(rawQuery, "bin") == "1", 1, 0),
 	}, nil
 
 }
 
 // show html view of lobby
-func ShowServersHtml(c *gin.Context) {
+func ShowServersHtml(w http.ResponseWriter, r *http.Request) {
 
-	GameServerClient, err := txGameServerGetAll()
+	gz := negotiateGzip(w, r)
+	page := HTMLPAGE.Get(REGISTRY.Snapshot())
 
-	if err != nil {
-		message := "<tr><td colspan='10'>Unable to read servers from the database.</td></tr>"
-		result := bytes.ReplaceAll(SERVERS_HTML, []byte("$$SERVERS$$"), []byte(message))
-		c.Data(http.StatusOK, gin.MIMEHTML, result)
+	sendEncoded(w, http.StatusOK, gin.MIMEHTML, &page.body, gz)
+}
 
-		return
-	}
+// SERVERS_HTML split around $$SERVERS$$, once at startup
+var SERVERS_HTML_HEAD, SERVERS_HTML_TAIL, _ = bytes.Cut(SERVERS_HTML, []byte("$$SERVERS$$"))
+
+const PLAYERS_AVAILABLE = "<img src='data:@file/png;base64,iVBORw0KGgoAAAANSUhEUgAAACAAAAAkCAMAAADfNcjQAAAAElBMVEUAAAD///+z9P9qfPR9hLL////Dr+VQAAAABnRSTlP//////wCzv6S/AAAACXBIWXMAAAsTAAALEwEAmpwYAAAAQElEQVQ4jWNkYsAPCMlTQQELAwMDAyMOyf/0ccOogsGjgBlXWqCjG1iYB4Eb/kMZ/9B0oPNp6AZGmApcdtPBDQA1JQVVAQAtagAAAABJRU5ErkJggg==' />"
+
+// pooled scratch buffers for renderServersHtml. Pages are copied out at their exact size.
+var htmlBuffers = sync.Pool{New: func() any { return new([]byte) }}
+
+// render the html view of the lobby for the rows of a snapshot
+func renderServersHtml(GameServerClient GameServerClientSlice) []byte {
 
-	ServerTemplate := `
-<tr>
-	<td class='server'>%s</td>
-	<td class='players'>%d/%d %s </td>
-</tr>
-`
-	GameTemplate := `
-<tr>
-	<td colspan='2' class='game'>%s</td>	
-</tr>
-`
-
-	PlayersAvailable := "<img src='data:@file/png;base64,iVBORw0KGgoAAAANSUhEUgAAACAAAAAkCAMAAADfNcjQAAAAElBMVEUAAAD///+z9P9qfPR9hLL////Dr+VQAAAABnRSTlP//////wCzv6S/AAAACXBIWXMAAAsTAAALEwEAmpwYAAAAQElEQVQ4jWNkYsAPCMlTQQELAwMDAyMOyf/0ccOogsGjgBlXWqCjG1iYB4Eb/kMZ/9B0oPNp6AZGmApcdtPBDQA1JQVVAQAtagAAAABJRU5ErkJggg==' />"
-
-	var servers string
+	scratch := htmlBuffers.Get().(*[]byte)
+	defer htmlBuffers.Put(scratch)
+
+	buf := append((*scratch)[:0], SERVERS_HTML_HEAD...)
+	rows := len(buf)
 	prevGame := ""
 
 	for i, gsc := range GameServerClient {
@@ -150,7 +160,9 @@ func ShowServersHtml(c *gin.Context) {
 
 			// Game type heading
 			if prevGame != gsc.Game {
-				servers += fmt.Sprintf(GameTemplate, html.EscapeString(gsc.Game))
+				buf = append(buf, "\n<tr>\n\t<td colspan='2' class='game'>"...)
+				buf = appendEscapedHtml(buf, gsc.Game)
+				buf = append(buf, "</td>\t\n</tr>\n"...)
 				prevGame = gsc.Game
 			}
 
@@ -159,63 +171,96 @@ func ShowServersHtml(c *gin.Context) {
 			// case "atari":
 			// 	platformIcons += "<img src='data:@file/png;base64,iVBORw0KGgoAAAANSUhEUgAAACgAAAAgCAMAAABXc8oyAAAADFBMVEUAAAD///+z9P////83isCuAAAABHRSTlP///8AQCqp9AAAAAlwSFlzAAALEwAACxMBAJqcGAAAAGhJREFUOI3tkcEOwCAIQ8vc//9yd1CyKh7Ek0vGDSGvLVqBFmEgAANh3eTCYv2Lpy7e2hB9p7/9hTA7qRmGmnvvjhCCDQp5YnRYX10jS2TzpVVdOjNHnPFG5jrR00aeMrMe57RXKUV8AGPEFFEoV1/yAAAAAElFTkSuQmCC'/>"
 			// case "apple2":
-			// 	platformIcons += "<img style='transform:scale(1.1)' src='data:image/png;base64,iVBORw0KGgoAAAANSUhEUgAAABsAAAAfCAMAAAAhm0ZxAAAADFBMVEUAAAD///+z9P////83isCuAAAABHRSTlP///8AQCqp9AAAAAlwSFlzAAALEwAACxMBAJqcGAAAAHNJREFUKJHFk8EKwDAIQ1/s/v+X3WHYdltT2GmehEeCGlTjXgnoamOBqp4Mz5JhudIVWrCOOCwplgU0Wmhxn3t2sIjc7CfCyeTvIiCMDD7d8zeWQMjAnWe+85th4E03cyrwwn1+Rlj5GddgDUXfT+N9RncC1+MPVhm/JmEAAAAASUVORK5CYII='/>"
+			// 	platformIcons += "<img style='transform:scale(1.1)' src='data:image/png;base64,iVBORw0KGgoAAAANSUhEUgAAABsAAAAfCAMAAAAhm0ZxAAAADFBMVEUAAAD///+z9P////83isCuAAAABHRSTlP///8AQCqp9AAAAAlwSFlzAAALEwAACxMBAJqcGAAAAHNJREFUKJHFk8EKwDAIQ1/s/v+X3WHYdltT2GmnvvjhCCDQp5YnRYX10jS2TzpVVdOjNHnPFG5jrR00aeMrMe57RXKUV8AGPEFFEoV1/yAAAAAElFTkSuQmCC'/>"
 			// }
 
 			// Add server if this is the last game client row for the server (reached the end, or next record is a different server/game)
 			if i == len(GameServerClient)-1 || gsc.Server != GameServerClient[i+1].Server || gsc.Game != GameServerClient[i+1].Game {
-				servers += fmt.Sprintf(ServerTemplate, html.EscapeString(gsc.Server), IfElse(gsc.Status == "online", gsc.Curplayers, 0), IfElse(gsc.Status == "online", gsc.Maxplayers, 0), IfElse(gsc.Curplayers > 0, PlayersAvailable, " "))
+				buf = append(buf, "\n<tr>\n\t<td class='server'>"...)
+				buf = appendEscapedHtml(buf, gsc.Server)
+				buf = append(buf, "</td>\n\t<td class='players'>"...)
+				buf = strconv.AppendInt(buf, int64(gsc.Curplayers), 10)
+				buf = append(buf, '/')
+				buf = strconv.AppendInt(buf, int64(gsc.Maxplayers), 10)
+				buf = append(buf, ' ')
+				buf = append(buf, IfElse(gsc.Curplayers > 0, PLAYERS_AVAILABLE, " ")...)
+				buf = append(buf, " </td>\n</tr>\n"...)
 			}
 		}
 	}
 
 	// if we have processed no servers, we put the 'no servers available message'
-	if len(servers) == 0 {
-		servers = "<tr><td colspan='10'>No servers available.</td></tr>"
-	} else {
+	if len(buf) == rows {
+		buf = append(buf, "<tr><td colspan='10'>No servers available.</td></tr>"...)
+	}
 
+	buf = append(buf, SERVERS_HTML_TAIL...)
+	*scratch = buf
+
+	return bytes.Clone(buf)
+}
+
+// append s to buf escaped as html.EscapeString does
+func appendEscapedHtml(buf []byte, s string) []byte {
+
+	for i := 0; i < len(s); i++ {
+
+		switch s[i] {
+		case '<':
+			buf = append(buf, "&lt;"...)
+		case '>':
+			buf = append(buf, "&gt;"...)
+		case '&':
+			buf = append(buf, "&amp;"...)
+		case '\'':
+			buf = append(buf, "&#39;"...)
+		case '"':
+			buf = append(buf, "&#34;"...)
+		default:
+			buf = append(buf, s[i])
+		}
 	}
 
-	result := bytes.ReplaceAll(SERVERS_HTML, []byte("$$SERVERS$$"), []byte(servers))
-	c.Data(http.StatusOK, gin.MIMEHTML, result)
+	return buf
 }
 
 // send the game servers stored to the client in full
 // TODO: sort the names, too confusing
-func ShowServers(c *gin.Context) {
+func ShowServers(w http.ResponseWriter, r *http.Request) {
 
-	GameServerClient, err := txGameServerGetAll()
+	snap := REGISTRY.Snapshot()
+	GameServerClient := snap.rows
 
-	if err != nil {
-		c.AbortWithStatusJSON(http.StatusInternalServerError,
-			gin.H{"success": false,
-				"message": "Database transaction issue",
-				"errors":  []string{err.Error()}})
+	if len(GameServerClient) == 0 {
+		writeJSON(w, http.StatusNotFound,
+			gin.H{"success": false, "message": "No servers available"})
 
 		return
+
 	}
 
-	if len(GameServerClient) == 0 {
-		c.AbortWithStatusJSON(http.StatusNotFound,
-			gin.H{"success": false, "message": "No servers available"})
+	gz := negotiateGzip(w, r)
+	etag := viewFullEtag(snap.generation)
 
+	if notModified(w, r, IfElse(gz, gzipEtag(etag), etag)) {
 		return
-
 	}
 
-	GameServerSlice := GameServerClient.toGameServerSlice()
+	page := VIEWFULL.Get(snap)
 
-	c.IndentedJSON(http.StatusOK, GameServerSlice)
+	sendEncoded(w, http.StatusOK, "application/json; charset=utf-8", &page.body, gz)
 }
 
 // insert/update uploaded server to the database. It also covers delete
-func UpsertServer(c *gin.Context) {
+func UpsertServer(w http.ResponseWriter, r *http.Request) {
 
-	server := GameServer{}
+	server, err1 := decodeGameServer(r.Body)
+	if bodyTooLarge(w, err1) {
+		return
+	}
 
-	err1 := c.ShouldBindJSON(&server)
 	if err1 != nil && err1.Error() == "EOF" {
-		c.AbortWithStatusJSON(http.StatusBadRequest,
+		writeJSON(w, http.StatusBadRequest,
 			gin.H{"success": false,
 				"message": "VALIDATEERR - Invalid Json",
 				"errors":  []string{"Submitted Json cannot be parsed"}})
@@ -227,17 +272,17 @@ func UpsertServer(c *gin.Context) {
 	err := errors.Join(err1, err2)
 
 	if err != nil {
-		c.AbortWithStatusJSON(http.StatusBadRequest,
+		writeJSON(w, http.StatusBadRequest,
 			gin.H{"success": false,
 				"message": "VALIDATEERR - Invalid Json",
 				"errors":  strings.Split(err.Error(), "\n")})
 		return
 	}
 
-	err = txGameServerUpsert(server)
+	err = REGISTRY.Upsert(server)
 
 	if err != nil {
-		c.AbortWithStatusJSON(http.StatusInternalServerError,
+		writeJSON(w, http.StatusInternalServerError,
 			gin.H{"success": false,
 				"message": "Database transaction issue",
 				"errors":  []string{err.Error()}})
@@ -245,34 +290,34 @@ func UpsertServer(c *gin.Context) {
 		return
 	}
 
-	if len(EVTSERVER_WEBHOOKS) > 0 {
-		go CallEventWebHook("POST", server, 2*time.Second)
-	}
-
-	c.JSON(http.StatusCreated, gin.H{"success": true,
+	writeJSON(w, http.StatusCreated, gin.H{"success": true,
 		"message": "Server correctly updated"})
 }
 
 // sends back the current server version + uptime
-func ShowStatus(c *gin.Context) {
-	c.JSON(http.StatusOK, gin.H{"success": true,
+func ShowStatus(w http.ResponseWriter, r *http.Request) {
+	writeJSON(w, http.StatusOK, gin.H{"success": true,
 		"version": STRINGVER,
 		"uptime":  uptime(STARTEDON)})
 }
 
 // show documentation in html
-func ShowDocs(c *gin.Context) {
-	c.Data(http.StatusOK, gin.MIMEHTML, DOCHTML)
+func ShowDocs(w http.ResponseWriter, r *http.Request) {
+	sendEncoded(w, http.StatusOK, gin.MIMEHTML, DOCS, negotiateGzip(w, r))
 }
 
 // delete server from database. It doesn't check if it exists.
-func DeleteServer(c *gin.Context) {
+func DeleteServer(w http.ResponseWriter, r *http.Request) {
 
 	server := GameServerDelete{}
 
-	err1 := c.ShouldBindJSON(&server)
+	err1 := binding.JSON.Bind(r, &server)
+	if bodyTooLarge(w, err1) {
+		return
+	}
+
 	if err1 != nil && err1.Error() == "EOF" {
-		c.AbortWithStatusJSON(http.StatusBadRequest,
+		writeJSON(w, http.StatusBadRequest,
 			gin.H{
 				"success": false,
 				"message": "VALIDATEERR - Invalid Json",
@@ -285,7 +330,7 @@ func DeleteServer(c *gin.Context) {
 	err := errors.Join(err1, err2)
 
 	if err != nil {
-		c.AbortWithStatusJSON(http.StatusBadRequest,
+		writeJSON(w, http.StatusBadRequest,
 			gin.H{
 				"success": false,
 				"message": "VALIDATEERR - Invalid Json",
@@ -293,57 +338,16 @@ func DeleteServer(c *gin.Context) {
 		return
 	}
 
-	err = txGameServerDelete(server.Serverurl)
+	err = REGISTRY.Delete(server.Serverurl)
 
 	if err != nil {
-		c.AbortWithStatusJSON(http.StatusInternalServerError, gin.H{
+		writeJSON(w, http.StatusInternalServerError, gin.H{
 			"success": false, "message": "Database transaction issue",
 			"errors": []string{err.Error()}})
 
 		return
 	}
 
-	if len(EVTSERVER_WEBHOOKS) > 0 {
-		go CallEventWebHook("DELETE", server, 2*time.Second)
-	}
-
-	c.JSON(http.StatusNoContent, gin.H{"success": true,
+	writeJSON(w, http.StatusNoContent, gin.H{"success": true,
 		"message": "Server correctly deleted"})
 }
-
-// update the status of the server to the eventserver webhook
-// supports updates (POST) and deletion (DELETE)
-func CallEventWebHook(method string, ServerData any, time time.Duration) error {
-
-	DEBUG.Printf("CallEventWebHook: %v", EVTSERVER_WEBHOOKS)
-
-	json, err := json.MarshalIndent(ServerData, "", "\t")
-	if err != nil {
-		ERROR.Printf("Unable to json.Marshal %v", ServerData)
-		return err
-	}
-
-	for _, uri_webhook := range EVTSERVER_WEBHOOKS {
-		DEBUG.Printf("Processing webhook: %s", uri_webhook)
-		req, err := http.NewRequest(method, uri_webhook, bytes.NewBuffer(json))
-
-		if err != nil {
-			ERROR.Printf("Unable to create http.NewRequest for event webhook (%s)", err)
-			continue
-		}
-		req.Header.Set("X-Lobby-Client", VERSION)
-		req.Header.Set("Content-Type", "application/json")
-
-		client := &http.Client{Timeout: time}
-
-		resp, err := client.Do(req)
-		if err != nil {
-			ERROR.Printf("Unable to post event to webhook: %s (%s)", uri_webhook, err)
-			continue
-		}
-		defer resp.Body.Close()
-
-	}
-
-	return nil
-}
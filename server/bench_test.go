@@ -0,0 +1,205 @@
+package main
+
+import (
+	"bytes"
+	"fmt"
+	"io"
+	"net/http"
+	"net/http/httptest"
+	"testing"
+
+	"github.com/gin-gonic/gin"
+)
+
+// Benchmarks of the full handler path, against registries of different sizes:
+//
+//	go test -run '^$' -bench . -benchmem
+//
+// They replace the contents of the test database (see TestMain).
+var BENCH_SIZES = []int{10, 1000, 100000}
+
+// distinct requests built before the timer starts, sent in turn
+const BENCH_REQUESTS = 1024
+
+var BENCH_PLATFORMS = []string{"atari", "c64", "apple2", "spectrum", "msx2", "coco"}
+
+// server i of the synthetic registry: 2 clients, 9 in 10 online
+func syntheticServer(i int) GameServer {
+
+	return GameServer{
+		Game:       fmt.Sprintf("Game %d", i%50),
+		Appkey:     i%10 + 1,
+		Server:     fmt.Sprintf("host%d.example.com", i),
+		Region:     []string{"eu", "us", "au"}[i%3],
+		Serverurl:  fmt.Sprintf("tcp://host%d.example.com:6502", i),
+		Status:     IfElse(i%10 == 9, "offline", "online"),
+		Maxplayers: 8,
+		Curplayers: i % 9,
+		Clients: []GameClient{
+			{Platform: BENCH_PLATFORMS[i%len(BENCH_PLATFORMS)], Url: fmt.Sprintf("tnfs://host%d.example.com/a.xex", i)},
+			{Platform: BENCH_PLATFORMS[(i+1)%len(BENCH_PLATFORMS)], Url: fmt.Sprintf("tnfs://host%d.example.com/b.xex", i)},
+		},
+	}
+}
+
+// fill the database and the registry with n synthetic servers
+func loadSyntheticServers(b *testing.B, n int) {
+
+	b.Helper()
+
+	DATABASE.Exec("DELETE FROM GameServer")
+
+	for start := 0; start < n; start += 1000 {
+
+		var ops []*writeOp
+
+		for i := start; i < min(start+1000, n); i++ {
+			ops = append(ops, &writeOp{server: syntheticServer(i)})
+		}
+
+		if err := txGameServerWriteBatch(ops); err != nil {
+			b.Fatal(err)
+		}
+	}
+
+	if err := REGISTRY.Reload(); err != nil {
+		b.Fatal(err)
+	}
+}
+
+// same routes and middleware as main, without the request logger
+func benchRouter(kind string) http.Handler {
+
+	gin.SetMode(gin.ReleaseMode)
+
+	return newRouter(kind, gin.New())
+}
+
+// request body that can be sent again, rewound before every request
+type benchBody struct {
+	*bytes.Reader
+}
+
+func (benchBody) Close() error {
+	return nil
+}
+
+func newBenchRequest(method string, target string, body string) *http.Request {
+
+	if body == "" {
+		req, _ := http.NewRequest(method, target, nil)
+		return req
+	}
+
+	req, _ := http.NewRequest(method, target, benchBody{bytes.NewReader([]byte(body))})
+	req.ContentLength = int64(len(body))
+
+	return req
+}
+
+// run the requests built by newRequest for every routing layer and registry
+// size. They are built before the timer starts, so only the handler is
+// measured. before, if not nil, runs ahead of every request.
+func benchmarkHandler(b *testing.B, newRequest func(i int, size int) *http.Request, before func()) {
+
+	for _, kind := range []string{ROUTER_GIN, ROUTER_MUX} {
+		b.Run("router="+kind, func(b *testing.B) {
+			benchmarkRouter(b, benchRouter(kind), newRequest, before)
+		})
+	}
+}
+
+func benchmarkRouter(b *testing.B, router http.Handler, newRequest func(i int, size int) *http.Request, before func()) {
+
+	for _, size := range BENCH_SIZES {
+
+		b.Run(fmt.Sprintf("servers=%d", size), func(b *testing.B) {
+
+			loadSyntheticServers(b, size)
+
+			requests := make([]*http.Request, min(b.N, BENCH_REQUESTS))
+
+			for i := range requests {
+				requests[i] = newRequest(i, size)
+			}
+
+			b.ReportAllocs()
+			b.ResetTimer()
+
+			for i := 0; i < b.N; i++ {
+
+				req := requests[i%len(requests)]
+
+				if body, ok := req.Body.(benchBody); ok {
+					body.Seek(0, io.SeekStart)
+				}
+
+				if before != nil {
+					before()
+				}
+
+				w := httptest.NewRecorder()
+				router.ServeHTTP(w, req)
+
+				if w.Code >= 300 {
+					b.Fatalf("HTTP %d: %s", w.Code, w.Body.String())
+				}
+			}
+		})
+	}
+}
+
+func BenchmarkUpsertServer(b *testing.B) {
+
+	benchmarkHandler(b, func(i int, size int) *http.Request {
+
+		// heartbeat of an existing server with a new player count
+		server := syntheticServer(i % size)
+		server.Curplayers = (server.Curplayers + i) % (server.Maxplayers + 1)
+
+		body := fmt.Sprintf(`{"game":%q,"appkey":%d,"server":%q,"region":%q,"serverurl":%q,"status":%q,"maxplayers":%d,"curplayers":%d,"clients":[{"platform":%q,"url":%q},{"platform":%q,"url":%q}]}`,
+			server.Game, server.Appkey, server.Server, server.Region, server.Serverurl, server.Status, server.Maxplayers, server.Curplayers,
+			server.Clients[0].Platform, server.Clients[0].Url, server.Clients[1].Platform, server.Clients[1].Url)
+
+		req := newBenchRequest("POST", "/server", body)
+		req.Header.Set("Content-Type", "application/json")
+
+		return req
+	}, nil)
+}
+
+func BenchmarkShowServersMinimised(b *testing.B) {
+
+	for _, bin := range []int{0, 1} {
+
+		// the same query every time, as 8-bit clients polling the lobby do
+		b.Run(fmt.Sprintf("bin=%d", bin), func(b *testing.B) {
+			benchmarkHandler(b, func(i int, size int) *http.Request {
+				return newBenchRequest("GET", fmt.Sprintf("/view?platform=atari&pagesize=10&bin=%d", bin), "")
+			}, nil)
+		})
+
+		// a different page every time, so every request is rendered
+		b.Run(fmt.Sprintf("bin=%d/uncached", bin), func(b *testing.B) {
+			benchmarkHandler(b, func(i int, size int) *http.Request {
+				return newBenchRequest("GET", fmt.Sprintf("/view?platform=atari&pagesize=10&bin=%d&offset=%d", bin, i%max(size/len(BENCH_PLATFORMS)/2, 1)), "")
+			}, func() {
+				VIEWCACHE = viewCache{}
+			})
+		})
+	}
+}
+
+func BenchmarkShowServers(b *testing.B) {
+
+	benchmarkHandler(b, func(i int, size int) *http.Request {
+		return newBenchRequest("GET", "/viewFull", "")
+	}, nil)
+}
+
+func BenchmarkShowServersHtml(b *testing.B) {
+
+	benchmarkHandler(b, func(i int, size int) *http.Request {
+		return newBenchRequest("GET", "/", "")
+	}, nil)
+}
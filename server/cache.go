@@ -0,0 +1,269 @@
+package main
+
+import (
+	"bytes"
+	"encoding/json"
+	"fmt"
+	"hash/fnv"
+	"net/http"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/gin-gonic/gin"
+)
+
+// Ready-made /view responses, one per query clients actually send.
+//
+// Every entry is tagged with the registry generation it was rendered from, so an
+// upsert or delete invalidates the whole cache at once. JSON responses include
+// the ping age of each server, so they are also tagged with the 1 second TIME
+// tick. Binary responses leave the ping age out and live for a full generation.
+type viewCache struct {
+	mu         sync.RWMutex
+	generation uint64
+	entries    map[ShowServersMinimisedFormData]*viewPayload
+}
+
+type viewPayload struct {
+	generation  uint64
+	tick        uint64
+	status      int
+	contentType string
+	etag        string
+	body        []byte
+}
+
+// upper bound for distinct queries cached per generation. Anything past it is
+// rendered on every request instead of growing the cache.
+const VIEWCACHE_MAX_ENTRIES = 1024
+
+var VIEWCACHE viewCache
+
+// cached payload for the query, or nil if it must be rendered
+func (vc *viewCache) Get(generation uint64, form ShowServersMinimisedFormData) *viewPayload {
+
+	vc.mu.RLock()
+	payload := vc.entries[form]
+	vc.mu.RUnlock()
+
+	if payload == nil || payload.generation != generation {
+		return nil
+	}
+
+	if form.Bin == 0 && payload.tick != atomic.LoadUint64(&TIME) {
+		return nil
+	}
+
+	return payload
+}
+
+func (vc *viewCache) Put(form ShowServersMinimisedFormData, payload *viewPayload) {
+
+	vc.mu.Lock()
+	defer vc.mu.Unlock()
+
+	// a newer generation drops every older entry
+	if vc.entries == nil || payload.generation > vc.generation {
+		vc.entries = make(map[ShowServersMinimisedFormData]*viewPayload)
+		vc.generation = payload.generation
+	}
+
+	if payload.generation < vc.generation {
+		return
+	}
+
+	_, exists := vc.entries[form]
+
+	if len(vc.entries) >= VIEWCACHE_MAX_ENTRIES && !exists {
+		return
+	}
+
+	vc.entries[form] = payload
+}
+
+// Responses that only depend on the registry contents, rendered once per
+// registry generation: the html view of the lobby (/) and /viewFull. Neither
+// has ping ages, so a page stays valid until the next change to the registry.
+// The gzip version is kept next to it, see encodedBody.
+type generationCache struct {
+	current atomic.Pointer[generationPage]
+	render  func(snap *registrySnapshot) []byte
+}
+
+type generationPage struct {
+	generation uint64
+	body       encodedBody
+}
+
+var (
+	HTMLPAGE = generationCache{render: func(snap *registrySnapshot) []byte { return renderServersHtml(snap.rows) }}
+	VIEWFULL = generationCache{render: renderViewFull}
+)
+
+// page for the snapshot, rendered if the cached one is from another generation
+func (gc *generationCache) Get(snap *registrySnapshot) *generationPage {
+
+	cached := gc.current.Load()
+
+	if cached != nil && cached.generation == snap.generation {
+		return cached
+	}
+
+	page := &generationPage{generation: snap.generation, body: encodedBody{identity: gc.render(snap)}}
+
+	// keep the newest generation if requests from two generations race
+	for cached == nil || cached.generation < page.generation {
+
+		if gc.current.CompareAndSwap(cached, page) {
+			break
+		}
+
+		cached = gc.current.Load()
+	}
+
+	return page
+}
+
+// /viewFull body, indented as gin's IndentedJSON did
+func renderViewFull(snap *registrySnapshot) []byte {
+
+	servers := snap.rows.toGameServerSlice()
+
+	return servers.appendJSONIndent(make([]byte, 0, 256*len(servers)+64*len(snap.rows)))
+}
+
+// Per-request scratch for renderView: the page of servers and the body being
+// encoded. Pooled, as they are dropped as soon as the body is copied out at its
+// exact size.
+type viewScratch struct {
+	servers []GameServerMin
+	body    []byte
+}
+
+var viewScratches = sync.Pool{New: func() any { return new(viewScratch) }}
+
+// build the /view response for the query out of a registry snapshot
+func renderView(snap *registrySnapshot, form ShowServersMinimisedFormData) *viewPayload {
+
+	payload := &viewPayload{
+		generation: snap.generation,
+		tick:       atomic.LoadUint64(&TIME),
+	}
+
+	scratch := viewScratches.Get().(*viewScratch)
+	defer viewScratches.Put(scratch)
+
+	// one clock read for the ping age of every server
+	now := time.Now()
+	ServerMinSlice := scratch.servers[:0]
+	next := ""
+
+	minimize := func(gsc *GameServerClient) {
+		ServerMinSlice = append(ServerMinSlice, gsc.Minimize(now))
+	}
+
+	if len(form.After) > 0 {
+
+		// checked by parseShowServersMinimisedForm
+		after, _ := decodeCursor(form.After)
+
+		if last := snap.pageAfter(form.Platform, form.Appkey, form.Pagesize, after, minimize); last != nil {
+			next = encodeCursor(last)
+		}
+	} else {
+		snap.pageBy(form.Platform, form.Appkey, form.Pagesize, form.Offset, minimize)
+	}
+
+	scratch.servers = ServerMinSlice
+
+	if len(ServerMinSlice) == 0 {
+		payload.status = http.StatusNotFound
+		payload.contentType = "application/json; charset=utf-8"
+		payload.body, _ = json.Marshal(gin.H{"success": false,
+			"message": "No servers available for " + form.Platform})
+
+		return payload
+	}
+
+	payload.status = http.StatusOK
+	payload.etag = form.etag(payload.generation, IfElse(form.Bin == 1, 0, payload.tick))
+
+	if form.Bin == 1 {
+
+		body, err := SerializeToBinaryFormat(ServerMinSlice, form, next)
+
+		if err != nil {
+			payload.status = http.StatusInternalServerError
+			payload.etag = ""
+			payload.contentType = "application/json; charset=utf-8"
+			payload.body, _ = json.Marshal(gin.H{"success": false, "message": err.Error()})
+
+			return payload
+		}
+
+		payload.contentType = "application/octet-stream"
+		payload.body = body
+	} else if len(form.After) > 0 {
+		payload.contentType = "application/json; charset=utf-8"
+		scratch.body = (&GameServerMinPage{Servers: ServerMinSlice, Next: next}).appendJSON(scratch.body[:0])
+		payload.body = bytes.Clone(scratch.body)
+	} else {
+		payload.contentType = "application/json; charset=utf-8"
+		scratch.body = appendGameServerMinSlice(scratch.body[:0], ServerMinSlice)
+		payload.body = bytes.Clone(scratch.body)
+	}
+
+	return payload
+}
+
+// Strong validator for a /view response: the registry generation plus a hash of
+// the query. JSON responses change every second (ping age) so they add the tick.
+// Generations restart on every run, so the start time keeps validators unique.
+func (form ShowServersMinimisedFormData) etag(generation uint64, tick uint64) string {
+
+	h := fnv.New64a()
+	fmt.Fprintf(h, "%s|%d|%d|%d|%s|%d", form.Platform, form.Appkey, form.Pagesize, form.Offset, form.After, form.Bin)
+
+	return fmt.Sprintf(`"%x.%x-%x-%016x"`, STARTEDON.Unix(), generation, tick, h.Sum64())
+}
+
+// validator for /viewFull, which only depends on the registry contents
+func viewFullEtag(generation uint64) string {
+	return fmt.Sprintf(`"%x.%x-full"`, STARTEDON.Unix(), generation)
+}
+
+// true if the If-None-Match request header matches etag (weak comparison, RFC 9110 13.1.2)
+func etagMatches(ifNoneMatch string, etag string) bool {
+
+	if len(ifNoneMatch) == 0 || len(etag) == 0 {
+		return false
+	}
+
+	for _, candidate := range strings.Split(ifNoneMatch, ",") {
+
+		candidate = strings.TrimSpace(candidate)
+
+		if candidate == "*" || strings.TrimPrefix(candidate, "W/") == etag {
+			return true
+		}
+	}
+
+	return false
+}
+
+// answer 304 Not Modified if the client already has etag. Otherwise set the
+// validator headers and let the caller send the body.
+func notModified(w http.ResponseWriter, r *http.Request, etag string) bool {
+
+	w.Header().Set("ETag", etag)
+	w.Header().Set("Cache-Control", "no-cache")
+
+	if etagMatches(r.Header.Get("If-None-Match"), etag) {
+		w.WriteHeader(http.StatusNotModified)
+		return true
+	}
+
+	return false
+}
@@ -0,0 +1,343 @@
+package main
+
+import (
+	"bytes"
+	"encoding/json"
+	"flag"
+	"fmt"
+	"io"
+	"math/rand"
+	"net/http"
+	"os"
+	"runtime"
+	"sort"
+	"sync"
+	"time"
+)
+
+// Load generator for the lobby server. Replays the traffic the lobby sees in
+// production against a running server:
+//
+//   - game servers sending a heartbeat (POST /server) every -heartbeat, with one
+//     player more or less each time
+//   - 8-bit lobby clients polling /view?bin=1 for their platform, a page of
+//     -pagesize servers at a time, paging through the list and starting over
+//     every -poll, as the cross-platform client does
+//   - a few browsers and integrations reading / and /viewFull
+//
+// At the end it reports, per operation, latency percentiles, bytes received and
+// the allocations the generator itself made. Allocations on the server side
+// are measured by the benchmarks in the server package (go test -bench .).
+//
+//	go run ./cmd/lobbyload -target http://localhost:8080 -duration 30s
+//
+// It registers -servers fake game servers on the target and deletes them when done.
+
+var PLATFORMS = []string{"atari", "c64", "apple2", "spectrum", "msx2", "coco", "adam", "lynx"}
+
+var (
+	target    string
+	duration  time.Duration
+	servers   int
+	clients   int
+	browsers  int
+	heartbeat time.Duration
+	poll      time.Duration
+	pagesize  int
+)
+
+// results of one kind of request
+type opStats struct {
+	name      string
+	latencies []time.Duration
+	errors    int
+	bytes     int64
+}
+
+func main() {
+
+	flag.StringVar(&target, "target", "http://localhost:8080", "<url> of the lobby server")
+	flag.DurationVar(&duration, "duration", 30*time.Second, "<duration> of the test")
+	flag.IntVar(&servers, "servers", 100, "<n> game servers sending heartbeats")
+	flag.IntVar(&clients, "clients", 500, "<n> 8-bit clients polling /view")
+	flag.IntVar(&browsers, "browsers", 10, "<n> browsers polling / and /viewFull")
+	flag.DurationVar(&heartbeat, "heartbeat", time.Second, "<duration> between heartbeats of a game server")
+	flag.DurationVar(&poll, "poll", time.Second, "<duration> between list refreshes of a client or browser")
+	flag.IntVar(&pagesize, "pagesize", 6, "<n> servers per /view page")
+
+	flag.Parse()
+
+	httpClient := &http.Client{
+		Timeout: 10 * time.Second,
+		Transport: &http.Transport{
+			MaxIdleConns:        servers + clients + browsers,
+			MaxIdleConnsPerHost: servers + clients + browsers,
+			IdleConnTimeout:     90 * time.Second,
+		},
+	}
+
+	var wg sync.WaitGroup
+	var mu sync.Mutex
+
+	results := map[string]*opStats{}
+
+	// every worker keeps its own stats and merges them when done
+	run := func(worker func(stop time.Time, record func(name string, start time.Time, n int64, err error))) {
+
+		wg.Add(1)
+
+		go func() {
+			defer wg.Done()
+
+			local := map[string]*opStats{}
+
+			worker(time.Now().Add(duration), func(name string, start time.Time, n int64, err error) {
+
+				stats := local[name]
+				if stats == nil {
+					stats = &opStats{name: name}
+					local[name] = stats
+				}
+
+				if err != nil {
+					stats.errors++
+					return
+				}
+
+				stats.latencies = append(stats.latencies, time.Since(start))
+				stats.bytes += n
+			})
+
+			mu.Lock()
+			defer mu.Unlock()
+
+			for name, stats := range local {
+
+				if results[name] == nil {
+					results[name] = &opStats{name: name}
+				}
+
+				results[name].latencies = append(results[name].latencies, stats.latencies...)
+				results[name].errors += stats.errors
+				results[name].bytes += stats.bytes
+			}
+		}()
+	}
+
+	var before, after runtime.MemStats
+	runtime.ReadMemStats(&before)
+
+	for i := 0; i < servers; i++ {
+		run(func(stop time.Time, record func(string, time.Time, int64, error)) {
+			gameServer(httpClient, i, stop, record)
+		})
+	}
+
+	for i := 0; i < clients; i++ {
+		run(func(stop time.Time, record func(string, time.Time, int64, error)) {
+			lobbyClient(httpClient, PLATFORMS[i%len(PLATFORMS)], stop, record)
+		})
+	}
+
+	for i := 0; i < browsers; i++ {
+		run(func(stop time.Time, record func(string, time.Time, int64, error)) {
+			browser(httpClient, stop, record)
+		})
+	}
+
+	wg.Wait()
+
+	runtime.ReadMemStats(&after)
+
+	// remove the fake servers
+	for i := 0; i < servers; i++ {
+		body, _ := json.Marshal(map[string]string{"serverurl": serverurl(i)})
+		send(httpClient, "DELETE", "/server", body)
+	}
+
+	report(results, after.Mallocs-before.Mallocs)
+}
+
+func serverurl(i int) string {
+	return fmt.Sprintf("tcp://lobbyload%d.example.com:6502/", i)
+}
+
+// POST /server every heartbeat, as game server i
+func gameServer(httpClient *http.Client, i int, stop time.Time, record func(string, time.Time, int64, error)) {
+
+	server := map[string]any{
+		"game":       fmt.Sprintf("Load %d", i%20),
+		"appkey":     i%10 + 1,
+		"server":     fmt.Sprintf("lobbyload%d.example.com", i),
+		"region":     []string{"eu", "us", "au"}[i%3],
+		"serverurl":  serverurl(i),
+		"status":     "online",
+		"maxplayers": 8,
+		"curplayers": 0,
+		"clients": []map[string]string{
+			{"platform": PLATFORMS[i%len(PLATFORMS)], "url": fmt.Sprintf("tnfs://lobbyload%d.example.com/a.xex", i)},
+			{"platform": PLATFORMS[(i+1)%len(PLATFORMS)], "url": fmt.Sprintf("tnfs://lobbyload%d.example.com/b.xex", i)},
+		},
+	}
+
+	players := 0
+
+	// servers don't start in step
+	time.Sleep(time.Duration(rand.Int63n(int64(heartbeat))))
+
+	for time.Now().Before(stop) {
+
+		players = max(0, min(8, players+rand.Intn(3)-1))
+		server["curplayers"] = players
+
+		body, _ := json.Marshal(server)
+
+		start := time.Now()
+		n, err := send(httpClient, "POST", "/server", body)
+		record("POST /server", start, n, err)
+
+		time.Sleep(heartbeat)
+	}
+}
+
+// Page through /view for platform every poll, like the cross-platform lobby
+// client: bin=1, pagesize and offset, until a page comes back short or 404.
+func lobbyClient(httpClient *http.Client, platform string, stop time.Time, record func(string, time.Time, int64, error)) {
+
+	time.Sleep(time.Duration(rand.Int63n(int64(poll))))
+
+	for time.Now().Before(stop) {
+
+		for offset := 0; time.Now().Before(stop); offset += pagesize {
+
+			start := time.Now()
+			n, status, err := get(httpClient, fmt.Sprintf("/view?bin=1&platform=%s&pagesize=%d&offset=%d", platform, pagesize, offset))
+			record("GET /view bin=1", start, n, err)
+
+			// 1 byte count and 2 reserved before the servers
+			if err != nil || status != http.StatusOK || n < int64(3+pagesize*BINARY_SERVER_SIZE) {
+				break
+			}
+		}
+
+		time.Sleep(poll)
+	}
+}
+
+// same size as the server's BINARY_SERVER_SIZE
+const BINARY_SERVER_SIZE = 1 + (16 + 1) + (32 + 1) + (64 + 1) + (64 + 1) + (2 + 1) + 3 + 2
+
+// the web page, the full list, and the json /view used by integrations
+func browser(httpClient *http.Client, stop time.Time, record func(string, time.Time, int64, error)) {
+
+	uris := []string{"/", "/viewFull", "/view?platform=atari"}
+
+	time.Sleep(time.Duration(rand.Int63n(int64(poll))))
+
+	for i := 0; time.Now().Before(stop); i++ {
+
+		uri := uris[i%len(uris)]
+
+		start := time.Now()
+		n, _, err := get(httpClient, uri)
+		record("GET "+uri, start, n, err)
+
+		time.Sleep(poll)
+	}
+}
+
+// GET uri. 404 is a valid answer (no servers for the platform).
+func get(httpClient *http.Client, uri string) (n int64, status int, err error) {
+
+	resp, err := httpClient.Get(target + uri)
+
+	if err != nil {
+		return 0, 0, err
+	}
+
+	defer resp.Body.Close()
+
+	n, err = io.Copy(io.Discard, resp.Body)
+
+	if err == nil && resp.StatusCode >= 300 && resp.StatusCode != http.StatusNotFound {
+		err = fmt.Errorf("http status %d", resp.StatusCode)
+	}
+
+	return n, resp.StatusCode, err
+}
+
+func send(httpClient *http.Client, method string, uri string, body []byte) (n int64, err error) {
+
+	req, err := http.NewRequest(method, target+uri, bytes.NewReader(body))
+
+	if err != nil {
+		return 0, err
+	}
+
+	req.Header.Set("Content-Type", "application/json")
+
+	resp, err := httpClient.Do(req)
+
+	if err != nil {
+		return 0, err
+	}
+
+	defer resp.Body.Close()
+
+	n, err = io.Copy(io.Discard, resp.Body)
+
+	if err == nil && resp.StatusCode >= 300 {
+		err = fmt.Errorf("http status %d", resp.StatusCode)
+	}
+
+	return n, err
+}
+
+func report(results map[string]*opStats, mallocs uint64) {
+
+	var names []string
+	total := 0
+
+	for name, stats := range results {
+		names = append(names, name)
+		total += len(stats.latencies) + stats.errors
+	}
+
+	sort.Strings(names)
+
+	fmt.Printf("%d requests in %s, %.0f req/s, %.1f client allocs/op\n\n",
+		total, duration, float64(total)/duration.Seconds(), float64(mallocs)/float64(max(total, 1)))
+
+	fmt.Printf("%-22s %8s %7s %8s %10s %10s %10s %10s %10s\n", "operation", "ok", "errors", "req/s", "p50", "p90", "p99", "max", "bytes/op")
+
+	for _, name := range names {
+
+		stats := results[name]
+		latencies := stats.latencies
+
+		sort.Slice(latencies, func(i, j int) bool { return latencies[i] < latencies[j] })
+
+		fmt.Printf("%-22s %8d %7d %8.0f %10s %10s %10s %10s %10d\n",
+			name, len(latencies), stats.errors, float64(len(latencies))/duration.Seconds(),
+			percentile(latencies, 50), percentile(latencies, 90), percentile(latencies, 99), percentile(latencies, 100),
+			stats.bytes/int64(max(len(latencies), 1)))
+	}
+
+	for _, stats := range results {
+		if stats.errors > 0 {
+			os.Exit(1)
+		}
+	}
+}
+
+// p-th percentile of sorted latencies (nearest rank)
+func percentile(latencies []time.Duration, p int) time.Duration {
+
+	if len(latencies) == 0 {
+		return 0
+	}
+
+	rank := (p*len(latencies) + 99) / 100
+
+	return latencies[max(rank, 1)-1].Round(time.Microsecond)
+}
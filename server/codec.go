@@ -0,0 +1,568 @@
+package main
+
+import (
+	"bytes"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"io"
+	"strconv"
+	"strings"
+	"sync"
+	"unicode/utf8"
+
+	"github.com/gin-gonic/gin/binding"
+)
+
+// Hand-written JSON for the hot paths, instead of reflection.
+//
+// The encoders append to a caller's buffer and produce the same bytes as
+// encoding/json (json.Marshal for /view, json.MarshalIndent with 4 spaces for
+// /viewFull). The decoder reads a POST /server body in a single pass and
+// applies the binding tags of GameServer (required, printascii, oneof) as each
+// field is parsed. Anything it doesn't expect (unknown or differently cased
+// keys, nulls, \u escapes, non ASCII, fractions, syntax errors...) is decoded
+// again with encoding/json and gin's validator, so clients always get the
+// same errors that ShouldBindJSON gave.
+
+const hex = "0123456789abcdef"
+
+// append s as a JSON string, escaped as encoding/json does (with HTML escaping)
+func appendJSONString(buf []byte, s string) []byte {
+
+	buf = append(buf, '"')
+	start := 0
+
+	for i := 0; i < len(s); {
+
+		if b := s[i]; b < utf8.RuneSelf {
+
+			if b >= 0x20 && b != '"' && b != '\\' && b != '<' && b != '>' && b != '&' {
+				i++
+				continue
+			}
+
+			buf = append(buf, s[start:i]...)
+
+			switch b {
+			case '"', '\\':
+				buf = append(buf, '\\', b)
+			case '\b':
+				buf = append(buf, '\\', 'b')
+			case '\f':
+				buf = append(buf, '\\', 'f')
+			case '\n':
+				buf = append(buf, '\\', 'n')
+			case '\r':
+				buf = append(buf, '\\', 'r')
+			case '\t':
+				buf = append(buf, '\\', 't')
+			default:
+				buf = append(buf, '\\', 'u', '0', '0', hex[b>>4], hex[b&0xF])
+			}
+
+			i++
+			start = i
+
+			continue
+		}
+
+		r, size := utf8.DecodeRuneInString(s[i:])
+
+		switch {
+		case r == utf8.RuneError && size == 1:
+			buf = append(buf, s[start:i]...)
+			buf = append(buf, `\ufffd`...)
+		case r == '\u2028' || r == '\u2029':
+			buf = append(buf, s[start:i]...)
+			buf = append(buf, '\\', 'u', '2', '0', '2', hex[r&0xF])
+		default:
+			i += size
+			continue
+		}
+
+		i += size
+		start = i
+	}
+
+	buf = append(buf, s[start:]...)
+
+	return append(buf, '"')
+}
+
+func appendJSONInt(buf []byte, name string, value int) []byte {
+	buf = append(buf, name...)
+	return strconv.AppendInt(buf, int64(value), 10)
+}
+
+func appendJSONField(buf []byte, name string, value string) []byte {
+	buf = append(buf, name...)
+	return appendJSONString(buf, value)
+}
+
+// same as json.Marshal(s)
+func (s *GameServerMin) appendJSON(buf []byte) []byte {
+
+	buf = appendJSONField(buf, `{"g":`, s.Game)
+	buf = appendJSONInt(buf, `,"t":`, s.AppKey)
+	buf = appendJSONField(buf, `,"u":`, s.Serverurl)
+	buf = appendJSONField(buf, `,"c":`, s.Client)
+	buf = appendJSONField(buf, `,"s":`, s.Server)
+	buf = appendJSONField(buf, `,"r":`, s.Region)
+	buf = appendJSONInt(buf, `,"o":`, s.Online)
+	buf = appendJSONInt(buf, `,"m":`, s.Maxplayers)
+	buf = appendJSONInt(buf, `,"p":`, s.Curplayers)
+	buf = appendJSONInt(buf, `,"a":`, s.Pingage)
+
+	return append(buf, '}')
+}
+
+// same as json.Marshal(servers)
+func appendGameServerMinSlice(buf []byte, servers []GameServerMin) []byte {
+
+	if servers == nil {
+		return append(buf, "null"...)
+	}
+
+	buf = append(buf, '[')
+
+	for i := range servers {
+
+		if i > 0 {
+			buf = append(buf, ',')
+		}
+
+		buf = servers[i].appendJSON(buf)
+	}
+
+	return append(buf, ']')
+}
+
+// same as json.Marshal(page)
+func (page *GameServerMinPage) appendJSON(buf []byte) []byte {
+
+	buf = append(buf, `{"servers":`...)
+	buf = appendGameServerMinSlice(buf, page.Servers)
+	buf = appendJSONField(buf, `,"next":`, page.Next)
+
+	return append(buf, '}')
+}
+
+// same as json.MarshalIndent(s, "", "    ")
+func (s GameServerSlice) appendJSONIndent(buf []byte) []byte {
+
+	if s == nil {
+		return append(buf, "null"...)
+	}
+
+	if len(s) == 0 {
+		return append(buf, "[]"...)
+	}
+
+	buf = append(buf, '[')
+
+	for i := range s {
+
+		if i > 0 {
+			buf = append(buf, ',')
+		}
+
+		gs := &s[i]
+
+		buf = appendJSONField(buf, "\n    {\n        \"game\": ", gs.Game)
+		buf = appendJSONInt(buf, ",\n        \"appkey\": ", gs.Appkey)
+		buf = appendJSONField(buf, ",\n        \"server\": ", gs.Server)
+		buf = appendJSONField(buf, ",\n        \"region\": ", gs.Region)
+		buf = appendJSONField(buf, ",\n        \"serverurl\": ", gs.Serverurl)
+		buf = appendJSONField(buf, ",\n        \"status\": ", gs.Status)
+		buf = appendJSONInt(buf, ",\n        \"maxplayers\": ", gs.Maxplayers)
+		buf = appendJSONInt(buf, ",\n        \"curplayers\": ", gs.Curplayers)
+		buf = append(buf, ",\n        \"clients\": "...)
+
+		switch {
+		case gs.Clients == nil:
+			buf = append(buf, "null"...)
+		case len(gs.Clients) == 0:
+			buf = append(buf, "[]"...)
+		default:
+			buf = append(buf, '[')
+
+			for j := range gs.Clients {
+
+				if j > 0 {
+					buf = append(buf, ',')
+				}
+
+				buf = appendJSONField(buf, "\n            {\n                \"platform\": ", gs.Clients[j].Platform)
+				buf = appendJSONField(buf, ",\n                \"url\": ", gs.Clients[j].Url)
+				buf = append(buf, "\n            }"...)
+			}
+
+			buf = append(buf, "\n        ]"...)
+		}
+
+		buf = append(buf, "\n    }"...)
+	}
+
+	return append(buf, "\n]"...)
+}
+
+// GameServer fields in struct order, as the validator reports them
+var GAMESERVER_FIELDS = [...]string{"Game", "Appkey", "Server", "Region", "Serverurl", "Status", "Maxplayers", "Curplayers", "Clients"}
+
+const (
+	FIELD_GAME = iota
+	FIELD_APPKEY
+	FIELD_SERVER
+	FIELD_REGION
+	FIELD_SERVERURL
+	FIELD_STATUS
+	FIELD_MAXPLAYERS
+	FIELD_CURPLAYERS
+	FIELD_CLIENTS
+)
+
+// pooled buffers for the request bodies. Decoded strings are copied out of them.
+var bodyBuffers = sync.Pool{New: func() any { return new(bytes.Buffer) }}
+
+// Decode and validate a GameServer from a request body, with the result and
+// errors of gin's ShouldBindJSON.
+func decodeGameServer(body io.Reader) (server GameServer, err error) {
+
+	if body == nil {
+		return server, errors.New("invalid request") // as gin's binding
+	}
+
+	buf := bodyBuffers.Get().(*bytes.Buffer)
+	defer bodyBuffers.Put(buf)
+
+	buf.Reset()
+
+	if _, err = buf.ReadFrom(body); err != nil {
+		return server, err
+	}
+
+	d := gameServerDecoder{data: buf.Bytes()}
+
+	if d.decode(&server) {
+		return server, d.validationErrors()
+	}
+
+	// the slow path: what ShouldBindJSON does
+	server = GameServer{}
+	err = json.NewDecoder(bytes.NewReader(buf.Bytes())).Decode(&server)
+
+	if err == nil && binding.Validator != nil {
+		err = binding.Validator.ValidateStruct(&server)
+	}
+
+	return server, err
+}
+
+// single pass parser of the GameServer JSON sent by game servers
+type gameServerDecoder struct {
+	data   []byte
+	pos    int
+	failed [len(GAMESERVER_FIELDS)]string // tag of the binding rule each field fails, "" if none
+}
+
+// Parse d.data into server. false if the input needs encoding/json.
+func (d *gameServerDecoder) decode(server *GameServer) bool {
+
+	// fields missing from the json fail their required tag
+	for _, field := range []int{FIELD_GAME, FIELD_APPKEY, FIELD_SERVER, FIELD_REGION, FIELD_SERVERURL, FIELD_STATUS, FIELD_MAXPLAYERS, FIELD_CLIENTS} {
+		d.failed[field] = "required"
+	}
+
+	return d.object(func(key []byte) bool {
+
+		var ok bool
+
+		switch string(key) {
+		case "game":
+			server.Game, ok = d.string()
+			d.failed[FIELD_GAME] = requiredPrintASCII(server.Game)
+		case "appkey":
+			server.Appkey, ok = d.int()
+			d.failed[FIELD_APPKEY] = IfElse(server.Appkey == 0, "required", "")
+		case "server":
+			server.Server, ok = d.string()
+			d.failed[FIELD_SERVER] = requiredPrintASCII(server.Server)
+		case "region":
+			server.Region, ok = d.string()
+			d.failed[FIELD_REGION] = requiredPrintASCII(server.Region)
+		case "serverurl":
+			server.Serverurl, ok = d.string()
+			d.failed[FIELD_SERVERURL] = IfElse(len(server.Serverurl) == 0, "required", "")
+		case "status":
+			server.Status, ok = d.string()
+			d.failed[FIELD_STATUS] = IfElse(len(server.Status) == 0, "required", IfElse(server.Status == "online" || server.Status == "offline", "", "oneof"))
+		case "maxplayers":
+			server.Maxplayers, ok = d.int()
+			d.failed[FIELD_MAXPLAYERS] = IfElse(server.Maxplayers == 0, "required", "")
+		case "curplayers":
+			server.Curplayers, ok = d.int()
+		case "clients":
+			server.Clients, ok = d.clients()
+			d.failed[FIELD_CLIENTS] = ""
+		}
+
+		return ok
+	})
+}
+
+// the binding errors, in the format of validator.ValidationErrors
+func (d *gameServerDecoder) validationErrors() (err error) {
+
+	for field, tag := range d.failed {
+		if len(tag) > 0 {
+			name := GAMESERVER_FIELDS[field]
+			err = errors.Join(err, fmt.Errorf("Key: 'GameServer.%s' Error:Field validation for '%s' failed on the '%s' tag", name, name, tag))
+		}
+	}
+
+	return err
+}
+
+// "required,printascii"
+func requiredPrintASCII(s string) string {
+
+	if len(s) == 0 {
+		return "required"
+	}
+
+	for i := 0; i < len(s); i++ {
+		if s[i] < 0x20 || s[i] > 0x7E {
+			return "printascii"
+		}
+	}
+
+	return ""
+}
+
+func (d *gameServerDecoder) clients() (clients []GameClient, ok bool) {
+
+	d.skipSpace()
+
+	if !d.consume('[') {
+		return nil, false
+	}
+
+	clients = make([]GameClient, 0, 4)
+
+	d.skipSpace()
+
+	if d.consume(']') {
+		return clients, true
+	}
+
+	for {
+		var client GameClient
+
+		ok = d.object(func(key []byte) bool {
+
+			var ok bool
+
+			switch string(key) {
+			case "platform":
+				client.Platform, ok = d.string()
+			case "url":
+				client.Url, ok = d.string()
+			}
+
+			return ok
+		})
+
+		if !ok {
+			return nil, false
+		}
+
+		clients = append(clients, client)
+
+		d.skipSpace()
+
+		switch {
+		case d.consume(','):
+			continue
+		case d.consume(']'):
+			return clients, true
+		}
+
+		return nil, false
+	}
+}
+
+// parse an object calling field for the value of every key. Unknown keys are
+// left to encoding/json: field returns false for them.
+func (d *gameServerDecoder) object(field func(key []byte) bool) bool {
+
+	d.skipSpace()
+
+	if !d.consume('{') {
+		return false
+	}
+
+	d.skipSpace()
+
+	if d.consume('}') {
+		return true
+	}
+
+	for {
+		key, ok := d.key()
+
+		if !ok {
+			return false
+		}
+
+		d.skipSpace()
+
+		if !d.consume(':') || !field(key) {
+			return false
+		}
+
+		d.skipSpace()
+
+		switch {
+		case d.consume(','):
+			d.skipSpace()
+			continue
+		case d.consume('}'):
+			return true
+		}
+
+		return false
+	}
+}
+
+func (d *gameServerDecoder) skipSpace() {
+
+	for d.pos < len(d.data) {
+
+		switch d.data[d.pos] {
+		case ' ', '\t', '\n', '\r':
+			d.pos++
+		default:
+			return
+		}
+	}
+}
+
+func (d *gameServerDecoder) consume(b byte) bool {
+
+	if d.pos < len(d.data) && d.data[d.pos] == b {
+		d.pos++
+		return true
+	}
+
+	return false
+}
+
+// an object key without escapes, in place
+func (d *gameServerDecoder) key() (key []byte, ok bool) {
+
+	if !d.consume('"') {
+		return nil, false
+	}
+
+	end := bytes.IndexByte(d.data[d.pos:], '"')
+
+	if end < 0 {
+		return nil, false
+	}
+
+	key = d.data[d.pos : d.pos+end]
+
+	for _, b := range key {
+		if b < 0x20 || b >= utf8.RuneSelf || b == '\\' {
+			return nil, false
+		}
+	}
+
+	d.pos += end + 1
+
+	return key, true
+}
+
+// a string of printable ASCII with the usual escapes, but not \u
+func (d *gameServerDecoder) string() (s string, ok bool) {
+
+	d.skipSpace()
+
+	if !d.consume('"') {
+		return "", false
+	}
+
+	start := d.pos
+	var unescaped []byte
+
+	for d.pos < len(d.data) {
+
+		b := d.data[d.pos]
+
+		switch {
+		case b == '"':
+			if unescaped == nil {
+				s = string(d.data[start:d.pos])
+			} else {
+				s = string(append(unescaped, d.data[start:d.pos]...))
+			}
+
+			d.pos++
+
+			return s, true
+
+		case b == '\\' && d.pos+1 < len(d.data):
+			escaped := strings.IndexByte(`"\/bfnrt`, d.data[d.pos+1])
+
+			if escaped < 0 {
+				return "", false
+			}
+
+			unescaped = append(unescaped, d.data[start:d.pos]...)
+			unescaped = append(unescaped, "\"\\/\b\f\n\r\t"[escaped])
+			d.pos += 2
+			start = d.pos
+
+		case b < 0x20 || b >= utf8.RuneSelf || b == '\\':
+			return "", false
+
+		default:
+			d.pos++
+		}
+	}
+
+	return "", false
+}
+
+// an integer without fraction or exponent that fits an int
+func (d *gameServerDecoder) int() (n int, ok bool) {
+
+	d.skipSpace()
+
+	start := d.pos
+
+	d.consume('-')
+
+	digits := d.pos
+
+	for d.pos < len(d.data) && d.data[d.pos] >= '0' && d.data[d.pos] <= '9' {
+		d.pos++
+	}
+
+	// no digits, a leading zero, or more digits than an int64 always holds
+	if d.pos == digits || (d.data[digits] == '0' && d.pos-digits > 1) || d.pos-digits > 18 {
+		return 0, false
+	}
+
+	// a fraction or an exponent
+	if d.pos < len(d.data) && (d.data[d.pos] == '.' || d.data[d.pos] == 'e' || d.data[d.pos] == 'E') {
+		return 0, false
+	}
+
+	for _, digit := range d.data[digits:d.pos] {
+		n = n*10 + int(digit-'0')
+	}
+
+	return IfElse(d.data[start] == '-', -n, n), true
+}
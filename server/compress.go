@@ -0,0 +1,113 @@
+package main
+
+import (
+	"bytes"
+	"compress/gzip"
+	"net/http"
+	"strconv"
+	"strings"
+	"sync"
+)
+
+// A response body and its gzip encoding. The gzip version is compressed once,
+// the first time a client asks for it, and then served as is: a cached page
+// costs no CPU per request whatever the encoding.
+type encodedBody struct {
+	identity []byte
+
+	once    sync.Once
+	gzipped []byte
+}
+
+// gzip version of the body, compressed on first use
+func (b *encodedBody) Gzip() []byte {
+
+	b.once.Do(func() {
+
+		var buf bytes.Buffer
+		buf.Grow(len(b.identity) / 4)
+
+		zw, _ := gzip.NewWriterLevel(&buf, gzip.DefaultCompression)
+		zw.Write(b.identity)
+		zw.Close()
+
+		b.gzipped = buf.Bytes()
+	})
+
+	return b.gzipped
+}
+
+// Negotiate the encoding of a response: true if it goes gzip encoded. The
+// response varies with Accept-Encoding either way, which caches are told.
+func negotiateGzip(w http.ResponseWriter, r *http.Request) bool {
+
+	w.Header().Set("Vary", "Accept-Encoding")
+
+	return acceptsGzip(r.Header.Get("Accept-Encoding"))
+}
+
+// true if an Accept-Encoding request header accepts gzip (RFC 9110 12.5.3).
+// Every coding is read: gzip listed explicitly wins over *, wherever they are,
+// and q=0 means not acceptable.
+func acceptsGzip(acceptEncoding string) bool {
+
+	gz, star := -1.0, -1.0 // weights, -1 while not listed
+
+	for _, coding := range strings.Split(acceptEncoding, ",") {
+
+		name, params, _ := strings.Cut(coding, ";")
+
+		switch strings.ToLower(strings.TrimSpace(name)) {
+		case "gzip", "x-gzip":
+			gz = qvalue(params)
+		case "*":
+			star = qvalue(params)
+		}
+	}
+
+	if gz >= 0 {
+		return gz > 0
+	}
+
+	return star > 0
+}
+
+// weight of a coding from its parameters: 1 without q, 0 if q is not a number
+func qvalue(params string) float64 {
+
+	for _, param := range strings.Split(params, ";") {
+
+		name, value, _ := strings.Cut(param, "=")
+
+		if strings.EqualFold(strings.TrimSpace(name), "q") {
+
+			weight, err := strconv.ParseFloat(strings.TrimSpace(value), 64)
+
+			if err != nil {
+				return 0
+			}
+
+			return weight
+		}
+	}
+
+	return 1
+}
+
+// validator of the gzip version of a response with etag
+func gzipEtag(etag string) string {
+	return strings.TrimSuffix(etag, `"`) + `-gz"`
+}
+
+// answer with body, gzip encoded if negotiateGzip said so
+func sendEncoded(w http.ResponseWriter, status int, contentType string, body *encodedBody, gz bool) {
+
+	if gz {
+		w.Header().Set("Content-Encoding", "gzip")
+		writeData(w, status, contentType, body.Gzip())
+
+		return
+	}
+
+	writeData(w, status, contentType, body.identity)
+}
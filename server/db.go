@@ -2,17 +2,44 @@ package main
 
 import (
 	"database/sql"
+	"fmt"
+	"runtime"
+	"slices"
+	"strings"
+	"sync"
 
 	"github.com/jmoiron/sqlx"
-	_ "github.com/mattn/go-sqlite3"
+	"github.com/mattn/go-sqlite3"
 )
 
+// SQLite WAL allows one writer and many readers at the same time, so the writer
+// and the readers get separate pools: a single connection that takes the write
+// lock as soon as a transaction begins (_txlock=immediate), and a read only pool
+// with one connection per core.
 type lobbyDB struct {
-	*sqlx.DB
+	*sqlx.DB          // writer, one connection
+	reader   *sqlx.DB // read only, GOMAXPROCS connections
+
+	stmt lobbyStatements // prepared once at startup, see PrepareStatements
 
 	// add Errors https://pkg.go.dev/github.com/mattn/go-sqlite3@v1.14.14#ErrIoErr
 }
 
+// Every query in tx.go, parsed and planned once. Transactions reuse them with tx.Stmt.
+type lobbyStatements struct {
+	gameServerGetAll      *sqlx.Stmt
+	gameServerGetBy       *sqlx.Stmt
+	gameServerGetByAppkey *sqlx.Stmt
+	gameServerUpsert      *sqlx.Stmt
+	gameServerDelete      *sqlx.Stmt
+	clientsGetByServer    *sqlx.Stmt
+	clientInsert          *sqlx.Stmt
+	clientDelete          *sqlx.Stmt
+	platformInsert        *sqlx.Stmt
+	gameServerMarkOffline *sqlx.Stmt
+	gameServerDeleteStale *sqlx.Stmt
+}
+
 func (db *lobbyDB) Get(dest interface{}, query string, args ...interface{}) (err error) {
 
 	err = db.DB.Get(dest, query, args...)
@@ -49,17 +76,223 @@ func (db *lobbyDB) ExecIn(query string, args ...interface{}) (res sql.Result, er
 
 }
 
-func init_db() {
-	DATABASE = &lobbyDB{DB: sqlx.MustConnect("sqlite3", "db/lobby.sqlite3?_foreign_keys=on&_journal=WAL&_timeout=300")}
+// SQLite tuning, set with command line flags. Applied to every connection.
+type dbOptions struct {
+	MmapSize    int64  // PRAGMA mmap_size, in bytes
+	CacheSize   int    // PRAGMA cache_size, in pages if positive, in KiB if negative
+	Synchronous string // PRAGMA synchronous: OFF, NORMAL, FULL or EXTRA
+}
+
+const DATABASE_FILE = "db/lobby.sqlite3"
+
+func init_db(opts dbOptions) {
+
+	DATABASE = connect_db(DATABASE_FILE, opts)
 
 	DB.Println("Connected to lobby.sqlite3")
 
+	err := DATABASE.Migrate()
+
+	if err != nil {
+		DB.Fatalf("Unable to migrate the database schema (%s)", err)
+	}
+
+	err = DATABASE.CheckQueryPlans()
+
+	if err != nil {
+		DB.Fatalf("Read queries are not supported by the indexes (%s)", err)
+	}
+
+	err = DATABASE.PrepareStatements()
+
+	if err != nil {
+		DB.Fatalf("Unable to prepare the database statements (%s)", err)
+	}
+}
+
+var registerDriver sync.Once
+
+// open the writer and the reader pools of the database in file
+func connect_db(file string, opts dbOptions) *lobbyDB {
+
+	if !slices.Contains([]string{"OFF", "NORMAL", "FULL", "EXTRA"}, strings.ToUpper(opts.Synchronous)) {
+		DB.Fatalf("%s is not a valid value for PRAGMA synchronous", opts.Synchronous)
+	}
+
+	// registered once, with the options of the first connection
+	registerDriver.Do(func() {
+		sql.Register("sqlite3_lobby", &sqlite3.SQLiteDriver{
+			ConnectHook: func(conn *sqlite3.SQLiteConn) error {
+				_, err := conn.Exec(fmt.Sprintf("PRAGMA mmap_size=%d;PRAGMA cache_size=%d;PRAGMA synchronous=%s;",
+					opts.MmapSize, opts.CacheSize, opts.Synchronous), nil)
+				return err
+			},
+		})
+	})
+
+	db := &lobbyDB{
+		DB: sqlx.MustConnect("sqlite3_lobby", "file:"+file+"?_foreign_keys=on&_journal=WAL&_timeout=300&_txlock=immediate"),
+	}
+
+	db.SetMaxOpenConns(1)
+	db.SetMaxIdleConns(1)
+
 	// https://dev.to/lefebvre/speed-up-sqlite-with-write-ahead-logging-wal-do
 
 	// Configure Write Ahead Log
-	_, err := DATABASE.Exec(`PRAGMA busy_timeout=300;PRAGMA journal_mode=WAL;PRAGMA foreign_keys=ON;`)
+	_, err := db.Exec(`PRAGMA busy_timeout=300;PRAGMA journal_mode=WAL;PRAGMA foreign_keys=ON;`)
 
 	if err != nil {
 		DB.Fatalf("Unable to set PRAGMA correctly (%s)", err)
 	}
+
+	// opened after the writer, so the database is already in WAL mode
+	db.reader = sqlx.MustConnect("sqlite3_lobby", "file:"+file+"?mode=ro&_query_only=1&_foreign_keys=on&_timeout=300")
+	db.reader.SetMaxOpenConns(runtime.GOMAXPROCS(0))
+	db.reader.SetMaxIdleConns(runtime.GOMAXPROCS(0))
+
+	return db
+}
+
+// Prepare the statements used by tx.go. Must run after Migrate, as it may recreate the views.
+func (db *lobbyDB) PrepareStatements() (err error) {
+
+	statements := []struct {
+		stmt  **sqlx.Stmt
+		pool  *sqlx.DB
+		query string
+	}{
+		{&db.stmt.gameServerGetAll, db.reader, QUERY_GAMESERVER_GETALL},
+		{&db.stmt.gameServerGetBy, db.reader, QUERY_GAMESERVER_GETBY},
+		{&db.stmt.gameServerGetByAppkey, db.reader, QUERY_GAMESERVER_GETBY_APPKEY},
+		{&db.stmt.gameServerUpsert, db.DB, QUERY_GAMESERVER_UPSERT},
+		{&db.stmt.gameServerDelete, db.DB, QUERY_GAMESERVER_DELETE},
+		{&db.stmt.clientsGetByServer, db.DB, QUERY_CLIENTS_GETBY_SERVER},
+		{&db.stmt.clientInsert, db.DB, QUERY_CLIENT_INSERT},
+		{&db.stmt.clientDelete, db.DB, QUERY_CLIENT_DELETE},
+		{&db.stmt.platformInsert, db.DB, QUERY_PLATFORM_INSERT},
+		{&db.stmt.gameServerMarkOffline, db.DB, QUERY_GAMESERVER_MARK_OFFLINE},
+		{&db.stmt.gameServerDeleteStale, db.DB, QUERY_GAMESERVER_DELETE_STALE},
+	}
+
+	for _, s := range statements {
+
+		*s.stmt, err = s.pool.Preparex(s.query)
+
+		if err != nil {
+			return fmt.Errorf("%s: %w", strings.Join(strings.Fields(s.query), " "), err)
+		}
+	}
+
+	return nil
+}
+
+// Statements that bring a database created with an older lobby_schema.sql up to
+// date. They must be idempotent, as they run on every start.
+var MIGRATIONS = []string{
+	`CREATE INDEX IF NOT EXISTS idx_Clients_Platform ON Clients (client_platform ASC)`,
+	`CREATE TABLE IF NOT EXISTS Platforms (
+		platform TEXT NOT NULL PRIMARY KEY
+	)`,
+	`CREATE INDEX IF NOT EXISTS idx_GameServer_GameOrder ON GameServer (game ASC, status DESC, curplayers DESC, server ASC, serverurl, appkey, region, maxplayers, lastping)`,
+	`CREATE INDEX IF NOT EXISTS idx_GameServer_Liveness ON GameServer (appkey ASC, status DESC, lastping DESC, serverurl, game, server, region, maxplayers, curplayers)`,
+	`CREATE INDEX IF NOT EXISTS idx_Clients_ServerurlPlatform ON Clients (serverurl ASC, client_platform ASC, client_url ASC)`,
+	`CREATE INDEX IF NOT EXISTS idx_GameServer_Lastping ON GameServer (lastping ASC)`,
+	`DROP INDEX IF EXISTS idx_Clients_Serverurl`, // idx_Clients_ServerurlPlatform starts with serverurl
+	`DROP VIEW IF EXISTS GameServerClients`,
+	`CREATE VIEW GameServerClients AS SELECT GameServer.*, Clients.client_platform as client_platform, Clients.client_url as client_url FROM GameServer CROSS JOIN Clients ON GameServer.Serverurl = Clients.Serverurl`,
+}
+
+func (db *lobbyDB) Migrate() error {
+
+	for _, migration := range MIGRATIONS {
+
+		_, err := db.Exec(migration)
+
+		if err != nil {
+			return err
+		}
+	}
+
+	return txPlatformBackfill()
+}
+
+// Let SQLite refresh the statistics of the tables whose contents changed a lot
+// (https://sqlite.org/lang_analyze.html#periodically_run_pragma_optimize_)
+func (db *lobbyDB) Optimize() error {
+
+	_, err := db.Exec("PRAGMA optimize")
+
+	return err
+}
+
+// Copy the WAL back into the database and truncate it, so it doesn't keep the
+// size of the busiest moment. busy is true if readers kept it from completing.
+func (db *lobbyDB) Checkpoint() (busy bool, err error) {
+
+	var blocked, walPages, checkpointed int
+
+	err = db.QueryRow("PRAGMA wal_checkpoint(TRUNCATE)").Scan(&blocked, &walPages, &checkpointed)
+
+	return blocked != 0, err
+}
+
+// close the read only pool and the writer
+func (db *lobbyDB) Close() error {
+
+	db.reader.Close()
+
+	return db.DB.Close()
+}
+
+// Read queries with sample arguments, checked at startup with EXPLAIN QUERY PLAN.
+// Each plan must use the index in uses. sorts marks the platform filters, which sort
+// the servers they match instead of walking a GameServer index.
+var CHECKED_QUERIES = map[string]struct {
+	args  []interface{}
+	uses  string
+	sorts bool
+}{
+	QUERY_GAMESERVER_GETALL:       {nil, "idx_GameServer_GameOrder", false},
+	QUERY_GAMESERVER_GETBY:        {[]interface{}{"%atari%", 10, 0}, "idx_Clients_Platform", true},
+	QUERY_GAMESERVER_GETBY_APPKEY: {[]interface{}{"%atari%", 1, 10, 0}, "idx_Clients_Platform", true},
+}
+
+// Make sure every read query is served by its index, and unfiltered reads in index
+// order: a TEMP B-TREE in their plan means SQLite sorts every server on every request.
+func (db *lobbyDB) CheckQueryPlans() error {
+
+	type planStep struct {
+		Id      int    `db:"id"`
+		Parent  int    `db:"parent"`
+		Notused int    `db:"notused"`
+		Detail  string `db:"detail"`
+	}
+
+	for query, check := range CHECKED_QUERIES {
+
+		var plan []planStep
+
+		err := db.reader.Select(&plan, "EXPLAIN QUERY PLAN "+query, check.args...)
+
+		if err != nil {
+			return err
+		}
+
+		used := false
+
+		for _, step := range plan {
+			if !check.sorts && strings.Contains(step.Detail, "TEMP B-TREE") {
+				return fmt.Errorf("%s in %s", step.Detail, strings.Join(strings.Fields(query), " "))
+			}
+
+			used = used || slices.Contains(strings.Fields(step.Detail), check.uses)
+		}
+
+		if !used {
+			return fmt.Errorf("%s not used by %s", check.uses, strings.Join(strings.Fields(query), " "))
+		}
+	}
+
+	return nil
 }
@@ -0,0 +1,259 @@
+package main
+
+import (
+	"encoding/json"
+	"fmt"
+	"net/http"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/gin-gonic/gin"
+)
+
+// In-process log of the changes published by the registry, served on /events.
+//
+// Every snapshot the registry publishes after a write appends one event per
+// server written, tagged with the generation of that snapshot. Clients ask for
+// the events after the last generation they saw, either as a Server-Sent Events
+// stream or as a long poll. The log keeps the last EVENTLOG_SIZE events: a
+// client that fell further behind is told to reset, i.e. reload /viewFull.
+type eventLog struct {
+	mu      sync.Mutex
+	events  []registryEvent // ring buffer, oldest at start
+	start   int
+	dropped uint64        // generation of the newest event pushed out of the log, 0 if none
+	changed chan struct{} // closed and replaced on every append
+
+	closing   chan struct{} // closed on shutdown, see Close
+	closeOnce sync.Once
+}
+
+type registryEvent struct {
+	Generation uint64      `json:"generation"`
+	Type       string      `json:"type"` // upsert, delete or expire
+	Serverurl  string      `json:"serverurl"`
+	Server     *GameServer `json:"server,omitempty"` // upserts only
+}
+
+// long poll answer
+type registryEventPage struct {
+	Generation uint64          `json:"generation"` // since for the next request
+	Reset      bool            `json:"reset"`      // events were lost, reload /viewFull
+	Events     []registryEvent `json:"events"`
+}
+
+const (
+	EVENTLOG_SIZE        = 4096
+	EVENTS_LONGPOLL      = 25 * time.Second // below the usual proxy idle timeouts
+	EVENTS_SSE_KEEPALIVE = 15 * time.Second
+)
+
+const (
+	EVENT_UPSERT = "upsert"
+	EVENT_DELETE = "delete"
+	EVENT_EXPIRE = "expire"
+)
+
+var EVENTLOG = eventLog{changed: make(chan struct{}), closing: make(chan struct{})}
+
+// append the events of a published generation and wake up every waiting client
+func (l *eventLog) Append(events ...registryEvent) {
+
+	l.mu.Lock()
+	defer l.mu.Unlock()
+
+	for _, event := range events {
+
+		if len(l.events) < EVENTLOG_SIZE {
+			l.events = append(l.events, event)
+			continue
+		}
+
+		l.dropped = l.events[l.start].Generation
+		l.events[l.start] = event
+		l.start = (l.start + 1) % EVENTLOG_SIZE
+	}
+
+	close(l.changed)
+	l.changed = make(chan struct{})
+}
+
+// Events published after generation since, and a channel closed on the next
+// append. reset is true if some of those events are no longer in the log, or
+// since is ahead of the registry (e.g. it comes from before a restart).
+func (l *eventLog) Since(since uint64, current uint64) (events []registryEvent, reset bool, changed <-chan struct{}) {
+
+	l.mu.Lock()
+	defer l.mu.Unlock()
+
+	if since > current {
+		return nil, true, l.changed
+	}
+
+	n := len(l.events)
+
+	// events are in generation order: binary search the first one after since
+	first := sort.Search(n, func(i int) bool {
+		return l.events[(l.start+i)%n].Generation > since
+	})
+
+	// the client hasn't seen some of the events pushed out of the log. A client
+	// at the generation of the newest one has seen all of its events, even if
+	// that generation is split across the boundary.
+	if since < l.dropped {
+		reset = true
+	}
+
+	for i := first; i < n; i++ {
+		events = append(events, l.events[(l.start+i)%n])
+	}
+
+	return events, reset, l.changed
+}
+
+// end every long poll and stream, so a shutdown doesn't wait for them
+func (l *eventLog) Close() {
+	l.closeOnce.Do(func() { close(l.closing) })
+}
+
+// events for the writes of a patch published as generation
+func registryEvents(generation uint64, ops []*writeOp) []registryEvent {
+
+	events := make([]registryEvent, 0, len(ops))
+
+	for _, op := range ops {
+
+		event := registryEvent{Generation: generation, Type: EVENT_UPSERT, Serverurl: op.server.Serverurl}
+
+		if op.deleted {
+			event.Type = EVENT_DELETE
+		} else {
+			server := op.server
+			event.Server = &server
+		}
+
+		events = append(events, event)
+	}
+
+	return events
+}
+
+// stream of registry changes, SSE if the client accepts text/event-stream, long poll otherwise
+func ShowEvents(c *gin.Context) {
+
+	current := REGISTRY.Snapshot().generation
+	since := current
+
+	value := c.Query("since")
+
+	if len(value) == 0 {
+		value = c.GetHeader("Last-Event-ID") // set by EventSource when it reconnects
+	}
+
+	if len(value) > 0 {
+
+		parsed, err := strconv.ParseUint(value, 10, 64)
+
+		if err != nil {
+			c.AbortWithStatusJSON(http.StatusBadRequest, gin.H{
+				"success": false, "message": "since must be a registry generation"})
+			return
+		}
+
+		since = parsed
+	}
+
+	// long polls and streams outlive -readtimeout: don't leave a read
+	// deadline on the connection that could end them
+	http.NewResponseController(c.Writer).SetReadDeadline(time.Time{})
+
+	if strings.Contains(c.GetHeader("Accept"), "text/event-stream") {
+		streamEvents(c, since)
+	} else {
+		pollEvents(c, since)
+	}
+}
+
+// answer with the events after since, waiting up to EVENTS_LONGPOLL for one
+func pollEvents(c *gin.Context, since uint64) {
+
+	timeout := time.NewTimer(EVENTS_LONGPOLL)
+	defer timeout.Stop()
+
+	for {
+		current := REGISTRY.Snapshot().generation
+		events, reset, changed := EVENTLOG.Since(since, current)
+
+		// after a reset the client reloads /viewFull, which is at least at current
+		if reset {
+			c.JSON(http.StatusOK, registryEventPage{Generation: current, Reset: true, Events: events})
+			return
+		}
+
+		// the registry publishes a generation before its events are logged, so
+		// the cursor is the last event sent, not current
+		if len(events) > 0 {
+			c.JSON(http.StatusOK, registryEventPage{Generation: events[len(events)-1].Generation, Events: events})
+			return
+		}
+
+		select {
+		case <-changed:
+		case <-timeout.C:
+			c.JSON(http.StatusOK, registryEventPage{Generation: since, Events: []registryEvent{}})
+			return
+		case <-EVENTLOG.closing:
+			c.JSON(http.StatusOK, registryEventPage{Generation: since, Events: []registryEvent{}})
+			return
+		case <-c.Request.Context().Done():
+			return
+		}
+	}
+}
+
+// send the events after since as Server-Sent Events until the client goes away
+func streamEvents(c *gin.Context, since uint64) {
+
+	c.Header("Content-Type", "text/event-stream")
+	c.Header("Cache-Control", "no-cache")
+	c.Header("X-Accel-Buffering", "no") // don't let nginx buffer the stream
+	c.Status(http.StatusOK)
+
+	keepalive := time.NewTicker(EVENTS_SSE_KEEPALIVE)
+	defer keepalive.Stop()
+
+	for {
+		current := REGISTRY.Snapshot().generation
+		events, reset, changed := EVENTLOG.Since(since, current)
+
+		// the client reloads /viewFull and carries on from current
+		if reset {
+			fmt.Fprintf(c.Writer, "id: %d\nevent: reset\ndata: {}\n\n", current)
+			since = current
+			continue
+		}
+
+		for _, event := range events {
+
+			data, _ := json.Marshal(event)
+			fmt.Fprintf(c.Writer, "id: %d\nevent: %s\ndata: %s\n\n", event.Generation, event.Type, data)
+
+			since = event.Generation
+		}
+
+		c.Writer.Flush()
+
+		select {
+		case <-changed:
+		case <-keepalive.C:
+			fmt.Fprint(c.Writer, ": keepalive\n\n")
+		case <-EVENTLOG.closing:
+			return
+		case <-c.Request.Context().Done():
+			return
+		}
+	}
+}
@@ -8,6 +8,7 @@ require (
 	github.com/madflojo/tasks v1.2.1
 	github.com/mattn/go-sqlite3 v1.14.27
 	github.com/nsf/jsondiff v0.0.0-20230430225905-43f6cf3098c1
+	golang.org/x/sys v0.20.0
 )
 
 require (
@@ -34,7 +35,6 @@ require (
 	golang.org/x/arch v0.8.0 // indirect
 	golang.org/x/crypto v0.23.0 // indirect
 	golang.org/x/net v0.25.0 // indirect
-	golang.org/x/sys v0.20.0 // indirect
 	golang.org/x/text v0.15.0 // indirect
 	google.golang.org/protobuf v1.34.1 // indirect
 	gopkg.in/yaml.v3 v3.0.1 // indirect
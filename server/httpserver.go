@@ -0,0 +1,183 @@
+package main
+
+import (
+	"context"
+	"errors"
+	"net"
+	"net/http"
+	"os"
+	"time"
+
+	"github.com/gin-gonic/gin"
+)
+
+// Limits and tuning of the http server, set from the command line
+type httpOptions struct {
+	ReadHeaderTimeout time.Duration // to read the request headers
+	ReadTimeout       time.Duration // to read the whole request, body included
+	WriteTimeout      time.Duration // to write the response. 0 keeps /events streams open
+	IdleTimeout       time.Duration // keep-alive connections waiting for the next request
+	KeepAlive         bool          // HTTP keep-alives
+	MaxHeaderBytes    int
+	MaxBodyBytes      int64 // POST and DELETE bodies, 0 for no limit
+	Listeners         int   // SO_REUSEPORT listeners on the same address
+}
+
+var (
+	HTTPSERVER      *http.Server
+	SHUTDOWNTIMEOUT time.Duration // for the running requests to finish on shutdown
+)
+
+func newHTTPServer(handler http.Handler, opts httpOptions) *http.Server {
+
+	handler = limitBodies(handler, opts.MaxBodyBytes)
+
+	if RATELIMITER != nil {
+		handler = RATELIMITER.Wrap(handler)
+	}
+
+	server := &http.Server{
+		Handler:           handler,
+		ReadHeaderTimeout: opts.ReadHeaderTimeout,
+		ReadTimeout:       opts.ReadTimeout,
+		WriteTimeout:      opts.WriteTimeout,
+		IdleTimeout:       opts.IdleTimeout,
+		MaxHeaderBytes:    opts.MaxHeaderBytes,
+	}
+
+	server.SetKeepAlivesEnabled(opts.KeepAlive)
+
+	// long polls and streams on /events would hold the shutdown until they time out
+	server.RegisterOnShutdown(EVENTLOG.Close)
+
+	return server
+}
+
+// serve on n listeners until the server is shut down, see SignalHandler
+func serveHTTP(server *http.Server, srvaddr string, n int) error {
+
+	listeners, err := listen(srvaddr, n)
+
+	if err != nil {
+		return err
+	}
+
+	INFO.Printf("Listening and serving HTTP on %s (%d listeners)", listeners[0].Addr(), len(listeners))
+
+	errs := make(chan error, len(listeners))
+
+	for _, listener := range listeners {
+		go func(listener net.Listener) {
+			errs <- server.Serve(listener)
+		}(listener)
+	}
+
+	return <-errs
+}
+
+// One listener, or n listeners on the same address with SO_REUSEPORT, so the
+// kernel spreads new connections between them instead of having a single
+// accept loop for every core.
+func listen(srvaddr string, n int) (listeners []net.Listener, err error) {
+
+	if n <= 1 {
+		listener, err := net.Listen("tcp", srvaddr)
+
+		if err != nil {
+			return nil, err
+		}
+
+		return []net.Listener{listener}, nil
+	}
+
+	config := net.ListenConfig{Control: reusePort}
+
+	for i := 0; i < n; i++ {
+
+		listener, err := config.Listen(context.Background(), "tcp", srvaddr)
+
+		if err != nil {
+
+			for _, listener := range listeners {
+				listener.Close()
+			}
+
+			return nil, err
+		}
+
+		// a :0 address gets a port from the first listener, the others share it
+		srvaddr = listener.Addr().String()
+		listeners = append(listeners, listener)
+	}
+
+	return listeners, nil
+}
+
+// cap the size of POST and DELETE bodies, the only ones the lobby reads
+func limitBodies(handler http.Handler, limit int64) http.Handler {
+
+	if limit <= 0 {
+		return handler
+	}
+
+	return http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+
+		if r.Method == http.MethodPost || r.Method == http.MethodDelete {
+			r.Body = http.MaxBytesReader(w, r.Body, limit)
+		}
+
+		handler.ServeHTTP(w, r)
+	})
+}
+
+// answer 413 if err comes from a body over the limit of limitBodies
+func bodyTooLarge(w http.ResponseWriter, err error) bool {
+
+	var maxBytesErr *http.MaxBytesError
+
+	if !errors.As(err, &maxBytesErr) {
+		return false
+	}
+
+	writeJSON(w, http.StatusRequestEntityTooLarge,
+		gin.H{"success": false,
+			"message": "VALIDATEERR - Invalid Json",
+			"errors":  []string{err.Error()}})
+
+	return true
+}
+
+// Stop taking requests, wait up to SHUTDOWNTIMEOUT for the running ones, then
+// stop the background tasks, checkpoint the WAL, write the pending log lines
+// and exit with code.
+func shutdown(code int) {
+
+	if HTTPSERVER != nil {
+
+		ctx, cancel := context.WithTimeout(context.Background(), SHUTDOWNTIMEOUT)
+
+		if err := HTTPSERVER.Shutdown(ctx); err != nil {
+			WARN.Printf("Requests still running after %s, closing their connections", SHUTDOWNTIMEOUT)
+			HTTPSERVER.Close()
+		}
+
+		cancel()
+	}
+
+	if SCHEDULER != nil {
+		SCHEDULER.Stop()
+	}
+
+	if DATABASE != nil {
+
+		if busy, err := DATABASE.Checkpoint(); err != nil || busy {
+			WARN.Printf("WAL checkpoint on shutdown could not complete (busy: %v, error: %v)", busy, err)
+		}
+
+		DATABASE.Close()
+	}
+
+	LOGRING.Flush(time.Second)
+
+	os.Exit(code)
+}
@@ -35,6 +35,13 @@ CREATE TABLE GameServer (
 );
 CREATE UNIQUE INDEX idx_GameServer_Serverurl ON GameServer (Serverurl ASC);
 
+-- Covering indexes in the order the read queries sort by, so no query needs a temporary b-tree:
+-- ORDER BY Game, Status DESC, Curplayers DESC, Server and (filtering by appkey) ORDER BY Status DESC, Lastping DESC
+CREATE INDEX idx_GameServer_GameOrder ON GameServer (game ASC, status DESC, curplayers DESC, server ASC, serverurl, appkey, region, maxplayers, lastping);
+CREATE INDEX idx_GameServer_Liveness ON GameServer (appkey ASC, status DESC, lastping DESC, serverurl, game, server, region, maxplayers, curplayers);
+-- used by the reaper to find servers without a recent heartbeat
+CREATE INDEX idx_GameServer_Lastping ON GameServer (lastping ASC);
+
 
 CREATE TABLE Clients (
     serverurl TEXT NOT NULL,
@@ -42,9 +49,20 @@ CREATE TABLE Clients (
     client_url      TEXT NOT NULL, 
     FOREIGN KEY(serverurl) REFERENCES GameServer(serverurl) ON DELETE CASCADE
 );
-CREATE INDEX idx_Clients_Serverurl ON Clients (Serverurl ASC);
+CREATE INDEX idx_Clients_Platform ON Clients (client_platform ASC);
+CREATE INDEX idx_Clients_ServerurlPlatform ON Clients (serverurl ASC, client_platform ASC, client_url ASC);
+
+
+-- One row per distinct client platform. Platform queries are resolved against
+-- this small table first, and Clients is then searched by client_platform equality
+-- (idx_Clients_Platform).
+CREATE TABLE Platforms (
+    platform TEXT NOT NULL PRIMARY KEY
+);
 
 
-CREATE VIEW GameServerClients AS SELECT GameServer.*, Clients.client_platform as client_platform, Clients.client_url as client_url FROM GameServer JOIN Clients ON GameServer.Serverurl = Clients.Serverurl;
+-- CROSS JOIN keeps GameServer as the outer loop, so rows come out in index order.
+-- Only for unfiltered reads: platform filters join Platforms and Clients first (see tx.go)
+CREATE VIEW GameServerClients AS SELECT GameServer.*, Clients.client_platform as client_platform, Clients.client_url as client_url FROM GameServer CROSS JOIN Clients ON GameServer.Serverurl = Clients.Serverurl;
 
 COMMIT;
\ No newline at end of file
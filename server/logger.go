@@ -1,15 +1,33 @@
 package main
 
 import (
+	"bufio"
+	"fmt"
 	"io"
 	"log"
+	"net/http"
 	"os"
+	"runtime"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
 )
 
+// Loggers format their lines on the calling goroutine and hand them to LOGRING,
+// a lock-free ring buffer that a single background goroutine writes to stdout.
+// Requests never wait on stdout: if the ring is full the line is dropped and
+// counted. A disabled logger returns before formatting anything, caller
+// information included.
 type CustomLogger struct {
-	*log.Logger
-	name string
-	on   bool
+	name   string
+	prefix string
+	flag   int // log.Ldate, log.Ltime, log.Lmicroseconds and log.Lshortfile are honoured
+	on     bool
+
+	sample  uint64 // Sample is true 1 in sample times, see SetSampling
+	sampled uint64
 }
 
 func (logger *CustomLogger) GetName() string {
@@ -21,17 +39,23 @@ func (logger *CustomLogger) IsOn() bool {
 }
 
 func (logger *CustomLogger) SetActive(newstatus bool) {
+	logger.on = newstatus
+}
 
-	switch newstatus {
+// Sample is true 1 in n calls, for loggers that would otherwise log every
+// request. 0 turns sampling off: Sample is always false.
+func (logger *CustomLogger) SetSampling(n int) {
+	logger.sample = uint64(max(n, 0))
+}
 
-	case true:
-		logger.SetOutput(os.Stdout)
-		logger.on = true
-	case false:
-		logger.SetOutput(io.Discard)
-		logger.on = false
+// true if the logger is on and this call is one of the sampled ones
+func (logger *CustomLogger) Sample() bool {
 
+	if !logger.on || logger.sample == 0 {
+		return false
 	}
+
+	return atomic.AddUint64(&logger.sampled, 1)%logger.sample == 0
 }
 
 func (logger *CustomLogger) String() string {
@@ -45,11 +69,374 @@ func (logger *CustomLogger) String() string {
 
 func NewCustomLogger(name string, prefix string, flag int) CustomLogger {
 
+	LOGRING.start(os.Stdout)
+
 	logger := CustomLogger{
-		Logger: log.New(os.Stdout, prefix, log.LstdFlags|flag),
 		name:   name,
+		prefix: prefix,
+		flag:   log.LstdFlags | flag,
 		on:     true,
+		sample: 1,
 	}
 
 	return logger
 }
+
+func (logger *CustomLogger) Printf(format string, v ...any) {
+
+	if !logger.on {
+		return
+	}
+
+	line := logger.header(2)
+	*line = fmt.Appendf(*line, format, v...)
+
+	LOGRING.push(line)
+}
+
+func (logger *CustomLogger) Println(v ...any) {
+
+	if !logger.on {
+		return
+	}
+
+	line := logger.header(2)
+	*line = fmt.Appendln(*line, v...)
+
+	LOGRING.push(line)
+}
+
+// Printf prefixed with the function calling it and its caller, as in
+// "txGameServerWriteBatch/txGameServerUpsertIn error: ...".
+func (logger *CustomLogger) CallerPrintf(format string, v ...any) {
+
+	if !logger.on {
+		return
+	}
+
+	line := logger.header(2)
+	*line = appendCallers(*line, 3)
+	*line = append(*line, ' ')
+	*line = fmt.Appendf(*line, format, v...)
+
+	LOGRING.push(line)
+}
+
+// Structured line: msg followed by key=value pairs, as in
+//
+//	ACCESS.Printw("request", "method", "GET", "path", "/view", "status", 200)
+//
+// gives "request method=GET path=/view status=200".
+func (logger *CustomLogger) Printw(msg string, keysAndValues ...any) {
+
+	if !logger.on {
+		return
+	}
+
+	line := logger.header(2)
+	*line = append(*line, msg...)
+
+	for i := 0; i+1 < len(keysAndValues); i += 2 {
+		*line = append(*line, ' ')
+		*line = fmt.Append(*line, keysAndValues[i])
+		*line = append(*line, '=')
+		*line = appendLogValue(*line, keysAndValues[i+1])
+	}
+
+	LOGRING.push(line)
+}
+
+// Printf, then exit once every pending line is written. The line is written
+// even if the logger is off, without turning it on: other goroutines may be
+// logging with it.
+func (logger *CustomLogger) Fatalf(format string, v ...any) {
+
+	line := logger.header(2)
+	*line = fmt.Appendf(*line, format, v...)
+
+	LOGRING.push(line)
+
+	LOGRING.Flush(time.Second)
+	os.Exit(1)
+}
+
+// pooled line with the prefix, date and file of a logger, as log.Logger writes
+// them. depth as in runtime.Caller from header: 2 for the caller of Printf.
+func (logger *CustomLogger) header(depth int) *[]byte {
+
+	line := logLines.Get().(*[]byte)
+	buf := append((*line)[:0], logger.prefix...)
+
+	if logger.flag&(log.Ldate|log.Ltime|log.Lmicroseconds) != 0 {
+
+		now := time.Now()
+
+		if logger.flag&log.Ldate != 0 {
+			buf = now.AppendFormat(buf, "2006/01/02 ")
+		}
+
+		if logger.flag&log.Lmicroseconds != 0 {
+			buf = now.AppendFormat(buf, "15:04:05.000000 ")
+		} else if logger.flag&log.Ltime != 0 {
+			buf = now.AppendFormat(buf, "15:04:05 ")
+		}
+	}
+
+	// the only runtime.Caller of the logger, for loggers that are on
+	if logger.flag&(log.Lshortfile|log.Llongfile) != 0 {
+
+		_, file, lineno, ok := runtime.Caller(depth)
+
+		if !ok {
+			file, lineno = "???", 0
+		} else if logger.flag&log.Lshortfile != 0 {
+			file = file[strings.LastIndexByte(file, '/')+1:]
+		}
+
+		buf = append(buf, file...)
+		buf = append(buf, ':')
+		buf = strconv.AppendInt(buf, int64(lineno), 10)
+		buf = append(buf, ": "...)
+	}
+
+	*line = buf
+
+	return line
+}
+
+// "parent/function" for the function skip frames up (as in runtime.Callers from
+// appendCallers), with one stack walk instead of a runtime.Caller per frame
+func appendCallers(buf []byte, skip int) []byte {
+
+	var pcs [2]uintptr
+
+	names := [2]string{"unknown", "unknown"}
+	frames := runtime.CallersFrames(pcs[:runtime.Callers(skip, pcs[:])])
+
+	for i := range names {
+
+		frame, more := frames.Next()
+
+		if len(frame.Function) > 0 {
+			names[i] = shortFnName(frame.Function)
+		}
+
+		if !more {
+			break
+		}
+	}
+
+	buf = append(buf, names[1]...)
+	buf = append(buf, '/')
+
+	return append(buf, names[0]...)
+}
+
+// txGameServerUpsert for main.txGameServerUpsert, and for its closures
+func shortFnName(name string) string {
+
+	_, name, _ = strings.Cut(name, ".")
+	name, _, _ = strings.Cut(name, ".")
+
+	return name
+}
+
+func appendLogValue(buf []byte, value any) []byte {
+
+	switch v := value.(type) {
+	case string:
+		return appendLogString(buf, v)
+	case int:
+		return strconv.AppendInt(buf, int64(v), 10)
+	case int64:
+		return strconv.AppendInt(buf, v, 10)
+	case uint64:
+		return strconv.AppendUint(buf, v, 10)
+	case bool:
+		return strconv.AppendBool(buf, v)
+	case time.Duration:
+		return append(buf, v.String()...)
+	case error:
+		return appendLogString(buf, v.Error())
+	case nil:
+		return append(buf, "nil"...)
+	}
+
+	return appendLogString(buf, fmt.Sprint(value))
+}
+
+// s as is, or quoted if it would be ambiguous
+func appendLogString(buf []byte, s string) []byte {
+
+	if len(s) == 0 || strings.ContainsAny(s, " =\"\t\n\r") {
+		return strconv.AppendQuote(buf, s)
+	}
+
+	return append(buf, s...)
+}
+
+// One line per request, from MetricsMiddleware and measured. Every failed
+// request goes to WARN, the others to ACCESS 1 in its sampling.
+func logAccess(r *http.Request, code int, elapsed time.Duration) {
+
+	logger := &ACCESS
+
+	if code >= http.StatusInternalServerError {
+		logger = &WARN
+	} else if !ACCESS.Sample() {
+		return
+	}
+
+	logger.Printw("request", "method", r.Method, "path", r.URL.Path, "status", code, "duration", elapsed, "client", r.RemoteAddr)
+}
+
+// Bounded multi-producer single-consumer queue of log lines (Dmitry Vyukov's
+// bounded MPMC queue, with one consumer). Producers claim a slot with a CAS on
+// tail and publish it through the slot sequence number; no locks are taken.
+type logRing struct {
+	slots []logSlot
+	mask  uint64
+
+	tail    atomic.Uint64 // next slot to write
+	head    atomic.Uint64 // next slot to read, only the writer goroutine moves it
+	flushed atomic.Uint64 // head when the writer last flushed to out
+	dropped atomic.Uint64 // lines lost because the ring was full, not reported yet
+	lost    atomic.Uint64 // lines lost because the ring was full, ever
+
+	sleeping atomic.Bool   // writer waiting on wake
+	wake     chan struct{} // capacity 1
+	once     sync.Once
+}
+
+type logSlot struct {
+	seq  atomic.Uint64
+	line *[]byte
+}
+
+const LOGRING_SIZE = 8192 // a power of 2
+
+var LOGRING = newLogRing(LOGRING_SIZE)
+
+var logLines = sync.Pool{New: func() any { line := make([]byte, 0, 256); return &line }}
+
+func newLogRing(size int) *logRing {
+
+	ring := &logRing{
+		slots: make([]logSlot, size),
+		mask:  uint64(size - 1),
+		wake:  make(chan struct{}, 1),
+	}
+
+	for i := range ring.slots {
+		ring.slots[i].seq.Store(uint64(i))
+	}
+
+	return ring
+}
+
+// start the writer goroutine, once
+func (ring *logRing) start(out io.Writer) {
+	ring.once.Do(func() { go ring.run(out) })
+}
+
+// queue line, or drop it if the ring is full
+func (ring *logRing) push(line *[]byte) {
+
+	if n := len(*line); n == 0 || (*line)[n-1] != '\n' {
+		*line = append(*line, '\n')
+	}
+
+	for {
+		pos := ring.tail.Load()
+		slot := &ring.slots[pos&ring.mask]
+		seq := slot.seq.Load()
+
+		switch {
+		case seq == pos:
+
+			if !ring.tail.CompareAndSwap(pos, pos+1) {
+				continue
+			}
+
+			slot.line = line
+			slot.seq.Store(pos + 1)
+
+			// only the first line after the writer went idle pays for the wake up
+			if ring.sleeping.CompareAndSwap(true, false) {
+				select {
+				case ring.wake <- struct{}{}:
+				default:
+				}
+			}
+
+			return
+
+		case seq < pos:
+			ring.dropped.Add(1)
+			ring.lost.Add(1)
+			logLines.Put(line)
+			return
+		}
+
+		// another producer took the slot, try the next one
+	}
+}
+
+// next line, or nil if the ring is empty. Writer goroutine only.
+func (ring *logRing) pop() *[]byte {
+
+	pos := ring.head.Load()
+	slot := &ring.slots[pos&ring.mask]
+
+	if slot.seq.Load() != pos+1 {
+		return nil
+	}
+
+	line := slot.line
+	slot.line = nil
+	slot.seq.Store(pos + uint64(len(ring.slots)))
+	ring.head.Store(pos + 1)
+
+	return line
+}
+
+func (ring *logRing) run(out io.Writer) {
+
+	w := bufio.NewWriterSize(out, 64<<10)
+
+	for {
+		if line := ring.pop(); line != nil {
+			w.Write(*line)
+			logLines.Put(line)
+			continue
+		}
+
+		if dropped := ring.dropped.Swap(0); dropped > 0 {
+			fmt.Fprintf(w, "LOGGER: %d log lines dropped, the log writer couldn't keep up\n", dropped)
+		}
+
+		w.Flush()
+		ring.flushed.Store(ring.head.Load())
+
+		// a line queued between the last pop and sleeping is picked up here
+		ring.sleeping.Store(true)
+
+		if ring.head.Load() != ring.tail.Load() {
+			ring.sleeping.Store(false)
+			continue
+		}
+
+		<-ring.wake
+	}
+}
+
+// wait up to timeout for the lines queued so far to be written
+func (ring *logRing) Flush(timeout time.Duration) {
+
+	target := ring.tail.Load()
+	deadline := time.Now().Add(timeout)
+
+	for ring.flushed.Load() < target && time.Now().Before(deadline) {
+		time.Sleep(time.Millisecond)
+	}
+}
@@ -3,15 +3,18 @@ package main
 import (
 	"bytes"
 	_ "embed"
+	"errors"
 	"flag"
 	"fmt"
 	"log"
 	"net"
+	"net/http"
 	"net/url"
 	"os"
 	"os/signal"
 	"runtime"
 	"strings"
+	"sync/atomic"
 	"syscall"
 	"time"
 
@@ -27,6 +30,7 @@ var (
 	DEBUG  CustomLogger
 	LOGGER CustomLogger
 	DB     CustomLogger
+	ACCESS CustomLogger
 )
 
 var (
@@ -45,17 +49,52 @@ const (
 //go:embed doc.html
 var DOCHTML []byte
 
+var DOCS *encodedBody // DOCHTML with its tags replaced, see init_html
+
 //go:embed servers.html
 var SERVERS_HTML []byte
 
 func main() {
 
-	var srvaddr string
+	var srvaddr, routerkind string
 	var evtaddrs ArrayOfParams
 	var help, version bool
+	var batchwindow time.Duration
+	var webhookresync time.Duration
+	var offlinettl, deletettl time.Duration
+	var batchsize int
+	var accesslog int
+	var dbopts dbOptions
+	var httpopts httpOptions
+	var rateopts rateOptions
 
 	flag.StringVar(&srvaddr, "srvaddr", ":8080", "<address:port> for http server")
+	flag.StringVar(&routerkind, "router", ROUTER_GIN, "<gin|mux> routing layer: gin for every route, or net/http ServeMux for the hot ones")
+	flag.DurationVar(&httpopts.ReadHeaderTimeout, "readheadertimeout", 5*time.Second, "<duration> to read the headers of a request")
+	flag.DurationVar(&httpopts.ReadTimeout, "readtimeout", 15*time.Second, "<duration> to read a whole request, body included (0 disables it, /events clears it)")
+	flag.DurationVar(&httpopts.WriteTimeout, "writetimeout", 0, "<duration> to write a response (0 disables it, needed by /events streams)")
+	flag.DurationVar(&httpopts.IdleTimeout, "idletimeout", 2*time.Minute, "<duration> a keep-alive connection waits for its next request")
+	flag.BoolVar(&httpopts.KeepAlive, "keepalive", true, "keep connections open between requests (HTTP keep-alive)")
+	flag.IntVar(&httpopts.MaxHeaderBytes, "maxheaderbytes", 16<<10, "<bytes> of request headers")
+	flag.Int64Var(&httpopts.MaxBodyBytes, "maxbodybytes", 64<<10, "<bytes> of a POST or DELETE body (0 disables it)")
+	flag.IntVar(&httpopts.Listeners, "listeners", 1, "<n> SO_REUSEPORT listeners accepting connections on srvaddr")
+	flag.Float64Var(&rateopts.ReadRate, "readrate", 0, "<requests/s> per client for every route but POST/DELETE /server (0 disables it)")
+	flag.IntVar(&rateopts.ReadBurst, "readburst", 30, "<requests> a client can send at once over readrate")
+	flag.Float64Var(&rateopts.WriteRate, "writerate", 0, "<requests/s> per client for POST/DELETE /server (0 disables it)")
+	flag.IntVar(&rateopts.WriteBurst, "writeburst", 50, "<requests> a client can send at once over writerate")
+	flag.IntVar(&rateopts.MaxReads, "maxreads", 0, "<n> reads in flight before reads are turned away, heartbeats still go through (0 disables it)")
+	flag.StringVar(&rateopts.RealIPHeader, "realipheader", "", "<header> with the client address set by a trusted reverse proxy, e.g. X-Real-IP")
+	flag.IntVar(&accesslog, "accesslog", 1, "log 1 in <n> requests, failed ones are always logged (0 disables it)")
+	flag.DurationVar(&SHUTDOWNTIMEOUT, "shutdowntimeout", 10*time.Second, "<duration> for running requests to finish on SIGTERM/SIGINT")
 	flag.Var(&evtaddrs, "evtaddr", "<http> for event server webhook (multiple values accepted)")
+	flag.DurationVar(&webhookresync, "webhookresync", 0, "<duration> between full publications of every server to the event server webhooks (0 disables it)")
+	flag.DurationVar(&offlinettl, "offlinettl", 0, "<duration> without heartbeat before a server is set offline, e.g. 15m (0 disables it)")
+	flag.DurationVar(&deletettl, "deletettl", 0, "<duration> without heartbeat before a server is deleted, e.g. 168h (0 disables it)")
+	flag.DurationVar(&batchwindow, "batchwindow", 0, "<duration> to group server updates into a single transaction (0 disables it)")
+	flag.IntVar(&batchsize, "batchsize", 64, "<n> servers waiting that force a grouped transaction before batchwindow")
+	flag.Int64Var(&dbopts.MmapSize, "mmapsize", 64<<20, "<bytes> of the database to memory map (sqlite mmap_size)")
+	flag.IntVar(&dbopts.CacheSize, "cachesize", -16384, "sqlite page cache per connection, <pages> if positive, <KiB> if negative (sqlite cache_size)")
+	flag.StringVar(&dbopts.Synchronous, "synchronous", "NORMAL", "<OFF|NORMAL|FULL|EXTRA> sqlite synchronous mode")
 
 	flag.BoolVar(&version, "version", false, "show current version")
 	flag.BoolVar(&help, "help", false, "show this help")
@@ -72,33 +111,49 @@ func main() {
 		return
 	}
 
-	init_logger()
+	if routerkind != ROUTER_GIN && routerkind != ROUTER_MUX {
+		fmt.Fprintf(os.Stderr, "unknown router %s\n", routerkind)
+		flag.PrintDefaults()
+		return
+	}
+
+	init_logger(accesslog)
 	init_os_signal()
 	init_scheduler()
 	init_time()
-	init_db()
+	init_db(dbopts)
+	init_registry()
+	init_writebehind(batchwindow, batchsize)
 	init_html(srvaddr)
-	init_webhook(evtaddrs)
+	init_webhook(evtaddrs, webhookresync)
+	init_reaper(offlinettl, deletettl)
+	init_ratelimit(rateopts)
+
+	// requests are logged by MetricsMiddleware and measured, see logAccess
+	engine := gin.New()
+	engine.Use(gin.Recovery())
 
-	router := gin.Default()
+	router := newRouter(routerkind, engine)
 
-	router.GET("/", ShowServersHtml)
-	router.GET("/docs", ShowDocs)
-	router.GET("/viewFull", ShowServers)
-	router.GET("/view", ShowServersMinimised)
-	router.GET("/version", ShowStatus)
-	router.POST("/server", UpsertServer)
-	router.DELETE("/server", DeleteServer)
+	HTTPSERVER = newHTTPServer(router, httpopts)
 
-	router.Run(srvaddr)
+	INFO.Printf("Using the %s router", routerkind)
 
+	err := serveHTTP(HTTPSERVER, srvaddr, httpopts.Listeners)
+
+	if !errors.Is(err, http.ErrServerClosed) {
+		ERROR.Fatalf("Unable to start the http server: %s", err)
+	}
+
+	// shutting down, SignalHandler exits once the requests are drained
+	select {}
 }
 
 /*
  * Subsystems start here.
  */
 
-func init_logger() {
+func init_logger(accesslog int) {
 
 	INFO = NewCustomLogger("info", "INFO: ", log.LstdFlags)
 	WARN = NewCustomLogger("warn", "WARN: ", log.LstdFlags)
@@ -106,6 +161,9 @@ func init_logger() {
 	LOGGER = NewCustomLogger("logger", "LOGGER: ", log.LstdFlags)
 	DEBUG = NewCustomLogger("debug", "DEBUG: ", log.LstdFlags|log.Lshortfile)
 	DB = NewCustomLogger("db", "DB: ", log.LstdFlags)
+	ACCESS = NewCustomLogger("access", "ACCESS: ", log.LstdFlags)
+
+	ACCESS.SetSampling(accesslog)
 
 	value, ok := os.LookupEnv("LOG_LEVEL")
 
@@ -115,7 +173,7 @@ func init_logger() {
 }
 
 func init_scheduler() error {
-	SCHEDULER := tasks.New()
+	SCHEDULER = tasks.New()
 
 	TIME = 0
 
@@ -133,7 +191,7 @@ func ticker(s string) func() error {
 
 	return func() error {
 
-		TIME += 1
+		atomic.AddUint64(&TIME, 1)
 
 		return nil
 	}
@@ -156,10 +214,10 @@ func SignalHandler(sigchan chan os.Signal) {
 
 		case syscall.SIGTERM:
 			WARN.Println("Got SIGTERM. Program will terminate cleanly now.")
-			os.Exit(143)
+			shutdown(143)
 		case syscall.SIGINT:
 			WARN.Println("Got SIGINT. Program will terminate cleanly now.")
-			os.Exit(137)
+			shutdown(137)
 		}
 	}
 }
@@ -174,7 +232,7 @@ func uptime(start time.Time) string {
 	return time.Since(start).String()
 }
 
-// replace tags on DOCHTML
+// replace tags on DOCHTML and compress it
 func init_html(srvaddr string) {
 
 	srvaddr = strings.ToLower(srvaddr)
@@ -189,19 +247,24 @@ func init_html(srvaddr string) {
 
 	DOCHTML = bytes.ReplaceAll(DOCHTML, []byte("$$srvaddr$$"), []byte(srvaddr))
 	DOCHTML = bytes.ReplaceAll(DOCHTML, []byte("$$version$$"), []byte(VERSION))
+
+	// static, so compressed once here
+	DOCS = &encodedBody{identity: DOCHTML}
+	DOCS.Gzip()
 }
 
 // check the urls submited via command line are valid webhooks
-func init_webhook(evtaddrs ArrayOfParams) {
+func init_webhook(evtaddrs ArrayOfParams, resync time.Duration) {
 	if len(evtaddrs) == 0 {
 		return
 	}
 
-	for _, evtaddr := range evtaddrs {
+	// the urls themselves are never logged, as they may carry tokens
+	for i, evtaddr := range evtaddrs {
 
 		url, err := url.Parse(evtaddr)
 		if err != nil {
-			WARN.Printf("%s is not a valid url for the event server webhook. This eventserver won't be used", evtaddr)
+			WARN.Printf("-evtaddr #%d is not a valid url for the event server webhook. This eventserver won't be used", i+1)
 			continue
 		}
 
@@ -212,9 +275,10 @@ func init_webhook(evtaddrs ArrayOfParams) {
 			continue
 		}
 
-		INFO.Printf("%s will be used as eventserver webhook", evtaddr)
+		INFO.Printf("%s will be used as eventserver webhook %d", url.Host, len(EVTSERVER_WEBHOOKS))
 		EVTSERVER_WEBHOOKS = append(EVTSERVER_WEBHOOKS, evtaddr)
 
 	}
 
+	init_webhook_dispatcher(EVTSERVER_WEBHOOKS, 2*time.Second, resync)
 }
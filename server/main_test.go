@@ -2,30 +2,75 @@ package main
 
 import (
 	"bytes"
+	"compress/gzip"
+	"encoding/binary"
+	"encoding/json"
+	"flag"
 	"fmt"
+	"io"
 	"log"
 	"net/http"
 	"net/http/httptest"
 	"os"
+	"runtime"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
 	"testing"
+	"time"
 
 	"github.com/gin-gonic/gin"
-	"github.com/jmoiron/sqlx"
+	"github.com/gin-gonic/gin/binding"
 	"github.com/nsf/jsondiff" // TODO: can we use some core golang functionality?
 )
 
-var ROUTER = setupRouter()
+var ROUTER http.Handler
+
+// routing layer under test, see newRouter: go test -args -router mux
+var ROUTERKIND = flag.String("router", ROUTER_GIN, "<gin|mux> routing layer to test")
 
 func TestMain(m *testing.M) {
 
-	DATABASE = &lobbyDB{DB: sqlx.MustConnect("sqlite3", "db/lobby.sqlite3?_foreign_keys=on")}
-	DATABASE.Exec("DELETE FROM GameServer")
+	flag.Parse()
+	ROUTER = setupRouter()
+
 	DB = NewCustomLogger("db", "\u001b[36mDB: \u001B[0m", log.LstdFlags)
 	DB.SetActive(false) // we don't want the DB logger to pollute the test
+
+	// tests and benchmarks wipe the database: use a new one, never db/lobby.sqlite3
+	dir, err := os.MkdirTemp("", "lobby-test")
+
+	if err != nil {
+		log.Fatal(err)
+	}
+
+	schema, err := os.ReadFile("lobby_schema.sql")
+
+	if err != nil {
+		log.Fatal(err)
+	}
+
+	DATABASE = connect_db(dir+"/lobby.sqlite3", dbOptions{Synchronous: "NORMAL"})
+
+	if _, err = DATABASE.Exec(string(schema)); err != nil {
+		log.Fatal(err)
+	}
+
+	DATABASE.Migrate()
+	DATABASE.PrepareStatements()
+	DATABASE.Exec("DELETE FROM GameServer")
 	DEBUG = NewCustomLogger("debug", "\u001b[36mDEBUG: \u001B[0m", log.LstdFlags)
 	DEBUG.SetActive(false)
+	INFO = NewCustomLogger("info", "\u001b[36mINFO: \u001B[0m", log.LstdFlags)
+	INFO.SetActive(false)
+	REGISTRY.Reload()
 
-	os.Exit(m.Run())
+	code := m.Run()
+
+	DATABASE.Close()
+	os.RemoveAll(dir)
+	os.Exit(code)
 }
 
 var GameServersIn = []string{
@@ -287,16 +332,8 @@ var GameServersOut = `"[
 var GameServersOutMin = `[{"g":"Battleship","t":3,"u":"https://8bitBattleship.com/battlehuman","c":"https://8bitBattleship.com/specship.xex","s":"8bitBattleship.com","r":"apac","o":1,"m":2,"p":0,"a":0},{"g":"5 CARD STUD","t":2,"u":"tcp://thomcorner.com/pokerbots","c":"tcp://thomcorner.com/clientus/specpoker.xex","s":"erichomeserver.com","r":"us","o":1,"m":8,"p":1,"a":0},{"g":"Battleship","t":2,"u":"https://8bitBattleship.com/battlebots","c":"https://8bitBattleship.com/specship.xex","s":"8bitBattleship.com","r":"au","o":1,"m":2,"p":1,"a":0},{"g":"Super Chess","t":1,"u":"http://chess.rogersm.net/server","c":"http://chess.rogersm.net/speccychess.xex","s":"chess.rogersm.net","r":"eu","o":1,"m":2,"p":1,"a":0},{"g":"5 CARD STUD","t":3,"u":"tcp://thomcorner.com/server5","c":"tcp://thomcorner.com/specpoker.xex","s":"erichomeserver.com","r":"all","o":0,"m":3,"p":0,"a":0}]`
 var GameServersOutMinAppKey2 = `[{"g":"Battleship","t":2,"u":"https://8bitBattleship.com/battlebots","c":"https://8bitBattleship.com/specship.xex","s":"8bitBattleship.com","r":"au","o":1,"m":2,"p":1,"a":0},{"g":"5 CARD STUD","t":2,"u":"tcp://thomcorner.com/pokerbots","c":"tcp://thomcorner.com/clientus/specpoker.xex","s":"erichomeserver.com","r":"us","o":1,"m":8,"p":1,"a":0}]`
 
-func setupRouter() *gin.Engine {
-
-	router := gin.Default()
-
-	router.GET("/viewFull", ShowServers)
-	router.GET("/view", ShowServersMinimised)
-	router.POST("/server", UpsertServer)
-	router.GET("/version", ShowStatus)
-
-	return router
+func setupRouter() http.Handler {
+	return newRouter(*ROUTERKIND, gin.Default())
 }
 
 func assertHTTPAnswerJSON(w *httptest.ResponseRecorder, HTTPCode int, HTTPBody string) (err []error) {
@@ -524,3 +561,1240 @@ func TestViewInsertAndRetrieveServerAppId(t *testing.T) {
 	}
 
 }
+
+func TestRegistryMatchesDatabase(t *testing.T) {
+
+	for _, ServerJson := range GameServersIn {
+
+		w := httptest.NewRecorder()
+		w.Header().Add("Content-Type", "application/json")
+		req, _ := http.NewRequest("POST", "/server", bytes.NewBuffer([]byte(ServerJson)))
+		ROUTER.ServeHTTP(w, req)
+	}
+
+	queries := []struct {
+		platform                 string
+		appkey, pagesize, offset int
+	}{
+		{"spectrum", -1, 255, 0},
+		{"ATARI", -1, 255, 0},
+		{"atari", -1, 2, 1},
+		{"spectrum", 2, 255, 0},
+		{"c64", 3, 255, 0},
+		{"NoPlatform", -1, 255, 0},
+	}
+
+	for _, q := range queries {
+
+		fromDB, err := txGameServerGetBy(q.platform, q.appkey, q.pagesize, q.offset)
+		if err != nil {
+			t.Fatalf("txGameServerGetBy %v: %s", q, err)
+		}
+
+		fromRegistry := REGISTRY.Snapshot().GetBy(q.platform, q.appkey, q.pagesize, q.offset)
+
+		// servers pinged within the same second tie on Lastping, so compare those as sets
+		if q.appkey != -1 {
+			for _, rows := range []GameServerClientSlice{fromDB, fromRegistry} {
+				sort.Slice(rows, func(i, j int) bool { return rows[i].Client_url < rows[j].Client_url })
+			}
+		}
+
+		if len(fromDB) != len(fromRegistry) {
+			t.Errorf("%v: database returned %d rows, registry %d", q, len(fromDB), len(fromRegistry))
+			continue
+		}
+
+		for i := range fromDB {
+			if fromDB[i].Serverurl != fromRegistry[i].Serverurl || fromDB[i].Client_url != fromRegistry[i].Client_url {
+				t.Errorf("%v row %d: database %s %s, registry %s %s", q, i,
+					fromDB[i].Serverurl, fromDB[i].Client_url, fromRegistry[i].Serverurl, fromRegistry[i].Client_url)
+			}
+		}
+	}
+}
+
+func TestViewNotModified(t *testing.T) {
+
+	for _, ServerJson := range GameServersIn {
+
+		w := httptest.NewRecorder()
+		w.Header().Add("Content-Type", "application/json")
+		req, _ := http.NewRequest("POST", "/server", bytes.NewBuffer([]byte(ServerJson)))
+		ROUTER.ServeHTTP(w, req)
+	}
+
+	for _, uri := range []string{"/view?platform=spectrum&bin=1", "/viewFull"} {
+
+		w := httptest.NewRecorder()
+		req, _ := http.NewRequest("GET", uri, nil)
+		ROUTER.ServeHTTP(w, req)
+
+		etag := w.Header().Get("ETag")
+
+		if w.Code != 200 || len(etag) == 0 {
+			t.Fatalf("%s %s expecting HTTP 200 with an ETag, received HTTP %d ETag '%s'", req.Method, uri, w.Code, etag)
+		}
+
+		w = httptest.NewRecorder()
+		req, _ = http.NewRequest("GET", uri, nil)
+		req.Header.Set("If-None-Match", etag)
+		ROUTER.ServeHTTP(w, req)
+
+		if w.Code != 304 || w.Body.Len() != 0 {
+			t.Errorf("%s %s expecting HTTP 304 with no body, received HTTP %d with %d bytes", req.Method, uri, w.Code, w.Body.Len())
+		}
+
+		// any change to the registry invalidates the ETag
+		w = httptest.NewRecorder()
+		req, _ = http.NewRequest("POST", "/server", bytes.NewBuffer([]byte(GameServersIn[0])))
+		ROUTER.ServeHTTP(w, req)
+
+		w = httptest.NewRecorder()
+		req, _ = http.NewRequest("GET", uri, nil)
+		req.Header.Set("If-None-Match", etag)
+		ROUTER.ServeHTTP(w, req)
+
+		if w.Code != 200 || w.Header().Get("ETag") == etag {
+			t.Errorf("%s %s expecting HTTP 200 with a new ETag after an update, received HTTP %d ETag '%s'", req.Method, uri, w.Code, w.Header().Get("ETag"))
+		}
+	}
+}
+
+func TestViewCursorPagination(t *testing.T) {
+
+	postAll := func() {
+		for _, ServerJson := range GameServersIn {
+
+			w := httptest.NewRecorder()
+			w.Header().Add("Content-Type", "application/json")
+			req, _ := http.NewRequest("POST", "/server", bytes.NewBuffer([]byte(ServerJson)))
+			ROUTER.ServeHTTP(w, req)
+		}
+	}
+
+	fetch := func(after string, bin string) *httptest.ResponseRecorder {
+
+		w := httptest.NewRecorder()
+		req, _ := http.NewRequest("GET", "/view?platform=spectrum&pagesize=2&bin="+bin+"&after="+after, nil)
+		ROUTER.ServeHTTP(w, req)
+
+		return w
+	}
+
+	fetchPage := func(after string) (page GameServerMinPage) {
+
+		w := fetch(after, "0")
+
+		if err := json.Unmarshal(w.Body.Bytes(), &page); w.Code != 200 || err != nil {
+			t.Fatalf("GET /view after=%s expecting HTTP 200 with a page, received HTTP %d (%v)", after, w.Code, err)
+		}
+
+		return page
+	}
+
+	postAll()
+	defer postAll()
+
+	expected := REGISTRY.Snapshot().GetBy("spectrum", -1, -1, 0)
+	page := fetchPage(CURSOR_FIRST)
+
+	// binary pages carry the same cursor after the servers, its length in the header
+	if body := fetch(CURSOR_FIRST, "1").Body.Bytes(); len(body) < 3 ||
+		string(body[len(body)-int(binary.LittleEndian.Uint16(body[1:3])):]) != page.Next {
+		t.Errorf("binary page expecting the cursor %s after the servers, received %v", page.Next, body)
+	}
+
+	if w := fetch("12", "0"); w.Code != http.StatusBadRequest {
+		t.Errorf("GET /view with an invalid cursor expecting HTTP 400, received HTTP %d", w.Code)
+	}
+
+	// a server of the first page goes away between pages: the rows after it
+	// change position, but the next pages still start right after the first one
+	servers := page.Servers
+	REGISTRY.Delete(page.Servers[0].Serverurl)
+
+	for pages := 0; len(page.Next) > 0 && pages < 10; pages++ {
+		page = fetchPage(page.Next)
+		servers = append(servers, page.Servers...)
+	}
+
+	if len(servers) != len(expected) {
+		t.Fatalf("expecting %d servers across all pages, received %d", len(expected), len(servers))
+	}
+
+	for i := range expected {
+		if servers[i].Serverurl != expected[i].Serverurl {
+			t.Errorf("server %d: expecting %s, received %s", i, expected[i].Serverurl, servers[i].Serverurl)
+		}
+	}
+}
+
+// a server can list a platform more than once: its rows are paged one by one
+func TestViewCursorPaginationSamePlatform(t *testing.T) {
+
+	server := GameServer{Game: "Two Clients", Appkey: 7, Server: "twoclients", Region: "eu",
+		Serverurl: "tcp://twoclients.example.com/server", Status: "online", Maxplayers: 4,
+		Clients: []GameClient{
+			{Platform: "spectrum", Url: "tcp://twoclients.example.com/b.tap"},
+			{Platform: "spectrum", Url: "tcp://twoclients.example.com/a.tap"},
+		}}
+
+	if err := REGISTRY.Upsert(server); err != nil {
+		t.Fatal(err)
+	}
+
+	defer REGISTRY.Delete(server.Serverurl)
+
+	snap := REGISTRY.Snapshot()
+	expected := snap.GetBy("spectrum", -1, -1, 0)
+
+	var clients []string
+
+	// pages of one row: one of the boundaries falls between the two clients
+	for after, pages := CURSOR_FIRST, 0; len(after) > 0 && pages <= len(expected); pages++ {
+
+		page, next, err := snap.GetAfter("spectrum", -1, 1, after)
+
+		if err != nil {
+			t.Fatal(err)
+		}
+
+		for _, gsc := range page {
+			clients = append(clients, gsc.Serverurl+" "+gsc.Client_url)
+		}
+
+		after = next
+	}
+
+	if len(clients) != len(expected) {
+		t.Fatalf("expecting %d rows across all pages, received %d: %v", len(expected), len(clients), clients)
+	}
+
+	for i := range expected {
+		if row := expected[i].Serverurl + " " + expected[i].Client_url; clients[i] != row {
+			t.Errorf("row %d: expecting %s, received %s", i, row, clients[i])
+		}
+	}
+}
+
+// a Platforms table with the family and variant columns of earlier versions is
+// rebuilt, and platform filters keep matching
+func TestQueryPlans(t *testing.T) {
+
+	if err := DATABASE.CheckQueryPlans(); err != nil {
+		t.Error(err)
+	}
+}
+
+func TestQueryPlansPlatformFilter(t *testing.T) {
+
+	// through the view GameServer stays the outer loop and Clients is never searched by platform
+	const query = "SELECT * FROM GameServerClients WHERE client_platform IN (SELECT platform FROM Platforms WHERE platform LIKE $1) LIMIT $2 OFFSET $3"
+
+	check := CHECKED_QUERIES[QUERY_GAMESERVER_GETBY]
+	CHECKED_QUERIES[query] = check
+	defer delete(CHECKED_QUERIES, query)
+
+	if err := DATABASE.CheckQueryPlans(); err == nil || !strings.Contains(err.Error(), "idx_Clients_Platform not used") {
+		t.Errorf("expecting a platform filter through GameServerClients to be rejected, received %v", err)
+	}
+}
+
+func TestUpsertUpdatesClientsInPlace(t *testing.T) {
+
+	server := GameServer{}
+	json.Unmarshal([]byte(GameServersIn[1]), &server)
+
+	for _, clients := range [][]GameClient{
+		server.Clients,
+		{server.Clients[0], {Platform: "coco", Url: "https://8bitBattleship.com/cocoship.bin"}},
+		{server.Clients[0], server.Clients[0]},
+	} {
+
+		server.Clients = clients
+		body, _ := json.Marshal(server)
+
+		w := httptest.NewRecorder()
+		req, _ := http.NewRequest("POST", "/server", bytes.NewBuffer(body))
+		ROUTER.ServeHTTP(w, req)
+
+		if w.Code != 201 {
+			t.Fatalf("%s %s expecting HTTP 201, received HTTP %d", req.Method, req.URL.Path, w.Code)
+		}
+
+		all, err := txGameServerGetAll()
+		if err != nil {
+			t.Fatal(err)
+		}
+
+		var stored []string
+		for _, gsc := range all {
+			if gsc.Serverurl == server.Serverurl {
+				stored = append(stored, gsc.Client_platform+" "+gsc.Client_url)
+			}
+		}
+
+		var expected []string
+		for _, client := range clients {
+			expected = append(expected, client.Platform+" "+client.Url)
+		}
+
+		sort.Strings(stored)
+		sort.Strings(expected)
+
+		if fmt.Sprint(stored) != fmt.Sprint(expected) {
+			t.Errorf("expecting clients %v, stored %v", expected, stored)
+		}
+	}
+}
+
+func TestWriteBehindCoalescesUpdates(t *testing.T) {
+
+	init_writebehind(20*time.Millisecond, 1000)
+	defer func() { REGISTRY.batch = nil }()
+
+	server := GameServer{}
+	json.Unmarshal([]byte(GameServersIn[0]), &server)
+
+	var wg sync.WaitGroup
+
+	// concurrent heartbeats for the same server collapse into the last one queued
+	for curplayers := 0; curplayers <= server.Maxplayers; curplayers++ {
+
+		wg.Add(1)
+
+		go func(gs GameServer) {
+			defer wg.Done()
+
+			body, _ := json.Marshal(gs)
+			w := httptest.NewRecorder()
+			req, _ := http.NewRequest("POST", "/server", bytes.NewBuffer(body))
+			ROUTER.ServeHTTP(w, req)
+
+			if w.Code != 201 {
+				t.Errorf("%s %s expecting HTTP 201, received HTTP %d", req.Method, req.URL.Path, w.Code)
+			}
+		}(server)
+
+		server.Curplayers++
+	}
+
+	wg.Wait()
+
+	all, _ := txGameServerGetAll()
+	stored := map[int]bool{}
+
+	for _, gsc := range all {
+		if gsc.Serverurl == server.Serverurl {
+			stored[gsc.Curplayers] = true
+		}
+	}
+
+	for _, gsc := range REGISTRY.Snapshot().rows {
+		if gsc.Serverurl == server.Serverurl && !stored[gsc.Curplayers] {
+			t.Errorf("registry has curplayers %d, database has %v", gsc.Curplayers, stored)
+		}
+	}
+
+	if len(stored) != 1 {
+		t.Errorf("expecting a single version of the server stored, found %v", stored)
+	}
+}
+
+func TestWebhookRetriesFailedDeliveries(t *testing.T) {
+
+	var mu sync.Mutex
+	received := map[string]int{}
+	calls := 0
+
+	// the event server fails the first request, then accepts everything
+	evtserver := httptest.NewServer(http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		mu.Lock()
+		defer mu.Unlock()
+
+		if calls++; calls == 1 {
+			w.WriteHeader(http.StatusServiceUnavailable)
+			return
+		}
+
+		received[r.Method]++
+	}))
+	defer evtserver.Close()
+
+	init_webhook_dispatcher([]string{evtserver.URL}, time.Second, 0)
+	defer func() { WEBHOOKS = webhookDispatcher{} }()
+
+	server := GameServer{}
+	json.Unmarshal([]byte(GameServersIn[1]), &server)
+
+	WEBHOOKS.NotifyUpdate(server)
+	WEBHOOKS.NotifyDelete(GameServerDelete{Serverurl: "http://other.example.com/server"})
+
+	target := WEBHOOKS.targets[0]
+
+	for deadline := time.Now().Add(5 * time.Second); target.delivered.Load() < 2 && time.Now().Before(deadline); {
+		time.Sleep(10 * time.Millisecond)
+	}
+
+	mu.Lock()
+	defer mu.Unlock()
+
+	if target.delivered.Load() != 2 || target.retried.Load() != 1 || target.deadletters.Load() != 0 {
+		t.Errorf("expecting 2 delivered, 1 retried, 0 dead letters, found %d, %d, %d",
+			target.delivered.Load(), target.retried.Load(), target.deadletters.Load())
+	}
+
+	if received["POST"] != 1 || received["DELETE"] != 1 {
+		t.Errorf("expecting one POST and one DELETE, received %v", received)
+	}
+}
+
+func TestWebhookOnlySendsChanges(t *testing.T) {
+
+	evtserver := httptest.NewServer(http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {}))
+	defer evtserver.Close()
+
+	init_webhook_dispatcher([]string{evtserver.URL}, time.Second, 0)
+	defer func() { WEBHOOKS = webhookDispatcher{} }()
+
+	server := GameServer{}
+	json.Unmarshal([]byte(GameServersIn[0]), &server)
+
+	// same state again, then with the clients reordered: nothing to publish
+	reordered := server
+	reordered.Clients = []GameClient{server.Clients[2], server.Clients[0], server.Clients[1]}
+
+	changed := server
+	changed.Curplayers++
+
+	target := WEBHOOKS.targets[0]
+
+	waitDelivered := func(n uint64) {
+		for deadline := time.Now().Add(5 * time.Second); target.delivered.Load() < n && time.Now().Before(deadline); {
+			time.Sleep(10 * time.Millisecond)
+		}
+	}
+
+	// wait in between, otherwise the queue would coalesce both updates into one
+	WEBHOOKS.NotifyUpdate(server)
+	WEBHOOKS.NotifyUpdate(server)
+	WEBHOOKS.NotifyUpdate(reordered)
+	waitDelivered(1)
+
+	WEBHOOKS.NotifyUpdate(changed)
+	WEBHOOKS.NotifyUpdate(changed)
+	waitDelivered(2)
+
+	if target.delivered.Load() != 2 || WEBHOOKS.unchanged.Load() != 3 {
+		t.Errorf("expecting 2 updates sent and 3 unchanged, found %d sent and %d unchanged",
+			target.delivered.Load(), WEBHOOKS.unchanged.Load())
+	}
+}
+
+func TestWebhookResendsDeadLetters(t *testing.T) {
+
+	var calls atomic.Int32
+
+	// the event server rejects the first update, then accepts everything
+	evtserver := httptest.NewServer(http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		if calls.Add(1) == 1 {
+			w.WriteHeader(http.StatusBadRequest)
+		}
+	}))
+	defer evtserver.Close()
+
+	init_webhook_dispatcher([]string{evtserver.URL}, time.Second, 0)
+	defer func() { WEBHOOKS = webhookDispatcher{} }()
+
+	server := GameServer{}
+	json.Unmarshal([]byte(GameServersIn[0]), &server)
+
+	target := WEBHOOKS.targets[0]
+
+	WEBHOOKS.NotifyUpdate(server)
+
+	for deadline := time.Now().Add(5 * time.Second); target.deadletters.Load() < 1 && time.Now().Before(deadline); {
+		time.Sleep(10 * time.Millisecond)
+	}
+
+	// the same state again: it never reached the event server, so it is sent
+	WEBHOOKS.NotifyUpdate(server)
+
+	for deadline := time.Now().Add(5 * time.Second); target.delivered.Load() < 1 && time.Now().Before(deadline); {
+		time.Sleep(10 * time.Millisecond)
+	}
+
+	if target.deadletters.Load() != 1 || target.delivered.Load() != 1 || WEBHOOKS.unchanged.Load() != 0 {
+		t.Errorf("expecting 1 dead letter, 1 delivered and 0 unchanged, found %d, %d and %d",
+			target.deadletters.Load(), target.delivered.Load(), WEBHOOKS.unchanged.Load())
+	}
+}
+
+func TestEventsLongPoll(t *testing.T) {
+
+	since := REGISTRY.Snapshot().generation
+
+	server := GameServer{}
+	json.Unmarshal([]byte(GameServersIn[2]), &server)
+	body, _ := json.Marshal(server)
+
+	w := httptest.NewRecorder()
+	req, _ := http.NewRequest("POST", "/server", bytes.NewBuffer(body))
+	ROUTER.ServeHTTP(w, req)
+
+	w = httptest.NewRecorder()
+	req, _ = http.NewRequest("GET", fmt.Sprintf("/events?since=%d", since), nil)
+	ROUTER.ServeHTTP(w, req)
+
+	page := registryEventPage{}
+	json.Unmarshal(w.Body.Bytes(), &page)
+
+	if w.Code != 200 || page.Reset || len(page.Events) != 1 {
+		t.Fatalf("expecting HTTP 200 with one event, received HTTP %d %s", w.Code, w.Body.String())
+	}
+
+	event := page.Events[0]
+
+	if event.Type != EVENT_UPSERT || event.Serverurl != server.Serverurl || event.Server == nil ||
+		event.Generation != page.Generation || event.Generation <= since {
+		t.Errorf("unexpected event %+v in page generation %d", event, page.Generation)
+	}
+
+	// a generation from the future (e.g. before a restart) asks the client to reload
+	w = httptest.NewRecorder()
+	req, _ = http.NewRequest("GET", fmt.Sprintf("/events?since=%d", page.Generation+1000), nil)
+	ROUTER.ServeHTTP(w, req)
+
+	json.Unmarshal(w.Body.Bytes(), &page)
+
+	if !page.Reset {
+		t.Errorf("expecting a reset, received %s", w.Body.String())
+	}
+}
+
+// a long poll outlives the read timeout of the server, see ShowEvents
+func TestEventsLongPollOutlivesReadTimeout(t *testing.T) {
+
+	server := httptest.NewUnstartedServer(nil)
+	server.Config = newHTTPServer(ROUTER, httpOptions{ReadTimeout: 100 * time.Millisecond, KeepAlive: true})
+	server.Start()
+	defer server.Close()
+
+	since := REGISTRY.Snapshot().generation
+	answer := make(chan registryEventPage, 1)
+
+	go func() {
+
+		page := registryEventPage{}
+		resp, err := http.Get(fmt.Sprintf("%s/events?since=%d", server.URL, since))
+
+		if err == nil {
+			json.NewDecoder(resp.Body).Decode(&page)
+			resp.Body.Close()
+		}
+
+		answer <- page
+	}()
+
+	time.Sleep(300 * time.Millisecond)
+
+	gameserver := GameServer{}
+	json.Unmarshal([]byte(GameServersIn[3]), &gameserver)
+	body, _ := json.Marshal(gameserver)
+
+	w := httptest.NewRecorder()
+	req, _ := http.NewRequest("POST", "/server", bytes.NewBuffer(body))
+	ROUTER.ServeHTTP(w, req)
+
+	select {
+	case page := <-answer:
+		if len(page.Events) == 0 || page.Events[0].Serverurl != gameserver.Serverurl {
+			t.Errorf("long poll expecting the upsert of %s after the read timeout, received %+v", gameserver.Serverurl, page)
+		}
+	case <-time.After(5 * time.Second):
+		t.Errorf("long poll expecting an answer after the upsert")
+	}
+}
+
+func TestEventLogReset(t *testing.T) {
+
+	eventlog := eventLog{changed: make(chan struct{}), closing: make(chan struct{})}
+
+	// generation 2 has two events, every other one has one
+	eventlog.Append(registryEvent{Generation: 1})
+	eventlog.Append(registryEvent{Generation: 2}, registryEvent{Generation: 2})
+
+	for generation := uint64(3); generation < EVENTLOG_SIZE; generation++ {
+		eventlog.Append(registryEvent{Generation: generation})
+	}
+
+	resets := func(expected map[uint64]bool) {
+		for since, reset := range expected {
+			if _, received, _ := eventlog.Since(since, EVENTLOG_SIZE+1); received != reset {
+				t.Errorf("log dropping up to generation %d expecting reset %v after %d, received %v", eventlog.dropped, reset, since, received)
+			}
+		}
+	}
+
+	// full, nothing dropped yet
+	resets(map[uint64]bool{0: false, 1: false, 2: false})
+
+	// generation 1 is dropped: a client that saw it carries on
+	eventlog.Append(registryEvent{Generation: EVENTLOG_SIZE})
+	resets(map[uint64]bool{0: true, 1: false, 2: false})
+
+	// one of the events of generation 2 is dropped, the other one is still there
+	eventlog.Append(registryEvent{Generation: EVENTLOG_SIZE + 1})
+	resets(map[uint64]bool{0: true, 1: true, 2: false})
+}
+
+func TestReaperExpiresStaleServers(t *testing.T) {
+
+	server := GameServer{}
+	json.Unmarshal([]byte(GameServersIn[0]), &server)
+	server.Serverurl = "http://stale.example.com/server"
+	server.Status = "online"
+
+	if err := REGISTRY.Upsert(server); err != nil {
+		t.Fatal(err)
+	}
+
+	DATABASE.Exec("UPDATE GameServer SET Lastping = datetime('now', '-2 hours') WHERE Serverurl = $1", server.Serverurl)
+
+	statusOf := func() (statuses map[string]bool) {
+		statuses = map[string]bool{}
+		for _, gsc := range REGISTRY.Snapshot().rows {
+			if gsc.Serverurl == server.Serverurl {
+				statuses[gsc.Status] = true
+			}
+		}
+		return statuses
+	}
+
+	// a ttl longer than the server has been silent leaves it alone
+	if err := (reaper{offlinettl: 3 * time.Hour, deletettl: 3 * time.Hour}).reap(); err != nil {
+		t.Fatal(err)
+	}
+
+	if statuses := statusOf(); !statuses["online"] || len(statuses) != 1 {
+		t.Errorf("expecting the server online, found %v", statuses)
+	}
+
+	if err := (reaper{offlinettl: time.Hour}).reap(); err != nil {
+		t.Fatal(err)
+	}
+
+	var stored string
+	DATABASE.Get(&stored, "SELECT Status FROM GameServer WHERE Serverurl = $1", server.Serverurl)
+
+	if statuses := statusOf(); stored != "offline" || !statuses["offline"] || len(statuses) != 1 {
+		t.Errorf("expecting the server offline, found %s in the database and %v in the registry", stored, statuses)
+	}
+
+	generation := REGISTRY.Snapshot().generation
+
+	if err := (reaper{deletettl: time.Hour}).reap(); err != nil {
+		t.Fatal(err)
+	}
+
+	events, _, _ := EVENTLOG.Since(generation, REGISTRY.Snapshot().generation)
+
+	if statuses := statusOf(); len(statuses) != 0 || len(events) != 1 || events[0].Type != EVENT_EXPIRE {
+		t.Errorf("expecting the server deleted with an expire event, found %v and %+v", statuses, events)
+	}
+}
+
+func TestMetrics(t *testing.T) {
+
+	for _, uri := range []string{"/view?platform=spectrum&bin=1", "/view?platform=spectrum", "/nowhere"} {
+		w := httptest.NewRecorder()
+		req, _ := http.NewRequest("GET", uri, nil)
+		ROUTER.ServeHTTP(w, req)
+	}
+
+	// made up methods share a single series
+	w := httptest.NewRecorder()
+	req, _ := http.NewRequest("BREW", "/view", nil)
+	ROUTER.ServeHTTP(w, req)
+
+	w = httptest.NewRecorder()
+	req, _ = http.NewRequest("GET", "/metrics", nil)
+	ROUTER.ServeHTTP(w, req)
+
+	if strings.Contains(w.Body.String(), "BREW") {
+		t.Errorf("expecting no series for the method BREW in /metrics")
+	}
+
+	if w.Code != 200 {
+		t.Fatalf("%s %s expecting HTTP 200, received HTTP %d", req.Method, req.URL.Path, w.Code)
+	}
+
+	for _, expected := range []string{
+		`lobby_http_requests_total{route="/view",method="GET",format="bin",code="200"}`,
+		`lobby_http_requests_total{route="unmatched",method="GET",format="json",code="404"}`,
+		`lobby_http_request_duration_seconds_bucket{route="/view",method="GET",format="json",le="+Inf"}`,
+		`lobby_db_query_duration_seconds_count{function="txGameServerUpsert"}`,
+		`lobby_registry_clients{platform="spectrum"}`,
+		`method="other"`,
+		`go_goroutines`,
+	} {
+		if !strings.Contains(w.Body.String(), expected) {
+			t.Errorf("expecting %s in /metrics", expected)
+		}
+	}
+}
+
+func TestMetricsLabels(t *testing.T) {
+
+	if value := labelValue("a\"b\\c\nd\x01é"); value != `"a\"b\\c\nd`+"\x01é"+`"` {
+		t.Errorf("labelValue expecting only \\, \" and \\n escaped, received %s", value)
+	}
+
+	rowsByPlatform := map[string][]int{"other": {1}}
+
+	for i := 0; i < METRICS_PLATFORMS+10; i++ {
+		rowsByPlatform[fmt.Sprintf("platform%d", i)] = make([]int, i+1)
+	}
+
+	var buf bytes.Buffer
+	writePlatformMetrics(&buf, rowsByPlatform)
+
+	// the 10 smallest platforms and the one called other add up in other
+	lines := strings.Split(strings.TrimSpace(buf.String()), "\n")
+
+	if len(lines) != METRICS_PLATFORMS+1 || lines[len(lines)-1] != `lobby_registry_clients{platform="other"} 56` {
+		t.Errorf("expecting %d platforms and other, received\n%s", METRICS_PLATFORMS, buf.String())
+	}
+
+	target := &webhookTarget{index: 1, host: "events.example.com:8080"}
+
+	if labels := target.labels(); labels != `webhook="1",host="events.example.com:8080"` {
+		t.Errorf("webhook labels expecting its index and host only, received %s", labels)
+	}
+
+	// nothing listens on port 1: the error is logged with the target, neither with the token
+	target.uri = "http://127.0.0.1:1/webhook?token=secret"
+	target.client = &http.Client{Timeout: time.Second}
+
+	_, err := target.send(&webhookEvent{method: "POST"})
+
+	if line := fmt.Sprintf("Webhook %s failed (%v)", target, err); err == nil || strings.Contains(line, "secret") {
+		t.Errorf("expecting a delivery error logged without the webhook url, received %s", line)
+	}
+}
+
+func TestServersHtmlCachedPerGeneration(t *testing.T) {
+
+	server := GameServer{}
+	json.Unmarshal([]byte(GameServersIn[2]), &server)
+	server.Server = "<b>poker & co</b>"
+
+	if err := REGISTRY.Upsert(server); err != nil {
+		t.Fatal(err)
+	}
+
+	get := func() *httptest.ResponseRecorder {
+		w := httptest.NewRecorder()
+		req, _ := http.NewRequest("GET", "/", nil)
+		ROUTER.ServeHTTP(w, req)
+		return w
+	}
+
+	w := get()
+	page := HTMLPAGE.current.Load()
+
+	if w.Code != 200 || !strings.Contains(w.Body.String(), "<td class='server'>&lt;b&gt;poker &amp; co&lt;/b&gt;</td>") || strings.Contains(w.Body.String(), "$$SERVERS$$") {
+		t.Fatalf("expecting HTTP 200 with the escaped server row, received HTTP %d", w.Code)
+	}
+
+	if w = get(); HTMLPAGE.current.Load() != page || page.generation != REGISTRY.Snapshot().generation {
+		t.Errorf("expecting the page of generation %d to be served from the cache", REGISTRY.Snapshot().generation)
+	}
+
+	REGISTRY.Delete(server.Serverurl)
+
+	if w = get(); strings.Contains(w.Body.String(), "poker &amp; co") {
+		t.Errorf("expecting the page to be rendered again after a change")
+	}
+}
+
+func TestGzipNegotiation(t *testing.T) {
+
+	for _, ServerJson := range GameServersIn {
+		w := httptest.NewRecorder()
+		req, _ := http.NewRequest("POST", "/server", bytes.NewBuffer([]byte(ServerJson)))
+		ROUTER.ServeHTTP(w, req)
+	}
+
+	cases := map[string]bool{
+		"":                      false,
+		"gzip":                  true,
+		"br, gzip, deflate":     true,
+		"deflate, GZIP;q=0.5":   true,
+		"gzip;q=0":              false,
+		"identity, *":           true,
+		"identity;q=1, br;q=.9": false,
+		"*, gzip;q=0":           false,
+		"gzip;q=0, *":           false,
+		"*;q=0":                 false,
+		"br;q=1, *;q=0.1":       true,
+		"gzip; Q=0.5":           true,
+		"gzip;level=1;q=0":      false,
+		"x-gzip":                true,
+	}
+
+	for header, expected := range cases {
+		if acceptsGzip(header) != expected {
+			t.Errorf("acceptsGzip(%q): expecting %v", header, expected)
+		}
+	}
+
+	for _, uri := range []string{"/viewFull", "/"} {
+
+		w := httptest.NewRecorder()
+		req, _ := http.NewRequest("GET", uri, nil)
+		ROUTER.ServeHTTP(w, req)
+
+		identity := w.Body.Bytes()
+
+		w = httptest.NewRecorder()
+		req, _ = http.NewRequest("GET", uri, nil)
+		req.Header.Set("Accept-Encoding", "gzip")
+		ROUTER.ServeHTTP(w, req)
+
+		if w.Code != 200 || w.Header().Get("Content-Encoding") != "gzip" || w.Header().Get("Vary") != "Accept-Encoding" {
+			t.Fatalf("%s %s expecting HTTP 200 gzip encoded, received HTTP %d Content-Encoding '%s'", req.Method, uri, w.Code, w.Header().Get("Content-Encoding"))
+		}
+
+		zr, err := gzip.NewReader(w.Body)
+		if err != nil {
+			t.Fatal(err)
+		}
+
+		decoded, err := io.ReadAll(zr)
+
+		if err != nil || !bytes.Equal(decoded, identity) {
+			t.Errorf("%s %s gzip body doesn't decode to the identity body (%v)", req.Method, uri, err)
+		}
+
+		if uri == "/viewFull" && w.Header().Get("ETag") != gzipEtag(viewFullEtag(REGISTRY.Snapshot().generation)) {
+			t.Errorf("%s %s expecting the ETag of the gzip version, received '%s'", req.Method, uri, w.Header().Get("ETag"))
+		}
+	}
+}
+
+func TestCodecsMatchEncodingJson(t *testing.T) {
+
+	var servers []GameServerMin
+	var full GameServerSlice
+
+	for i, name := range []string{"Super Chess", `a<b>&c"d\e` + "\n\t\x01", "ünïcode", "bad\xffutf8", ""} {
+		servers = append(servers, GameServerMin{Game: name, AppKey: i, Serverurl: name, Client: name, Server: name, Region: name, Online: 1, Maxplayers: 8, Curplayers: i, Pingage: 30})
+		full = append(full, GameServer{Game: name, Appkey: i, Server: name, Region: name, Serverurl: name, Status: "online", Maxplayers: 8, Clients: []GameClient{{Platform: name, Url: name}, {Platform: "atari", Url: "tnfs://a/b"}}})
+	}
+
+	expected, _ := json.Marshal(servers)
+	if encoded := appendGameServerMinSlice(nil, servers); !bytes.Equal(encoded, expected) {
+		t.Errorf("GameServerMin: expecting %s, encoded %s", expected, encoded)
+	}
+
+	page := GameServerMinPage{Servers: servers, Next: "AUEBYgFj"}
+	expected, _ = json.Marshal(page)
+	if encoded := page.appendJSON(nil); !bytes.Equal(encoded, expected) {
+		t.Errorf("GameServerMinPage: expecting %s, encoded %s", expected, encoded)
+	}
+
+	expected, _ = json.MarshalIndent(full, "", "    ")
+	if encoded := full.appendJSONIndent(nil); !bytes.Equal(encoded, expected) {
+		t.Errorf("GameServerSlice: expecting %s, encoded %s", expected, encoded)
+	}
+
+	// the decoder answers as ShouldBindJSON, fast path or not
+	bodies := append([]string{
+		`{}`,
+		`{"game":"G","appkey":-0,"clients":[]} trailing`,
+		`{"game":"G\u00e9","status":"busy","server":"\t","clients":[{}],"game":"H"}`,
+		`{"appkey":1.0}`,
+		`{"appkey":"1"}`,
+		`{"Game":"x","extra":[1,2]}`,
+		`{"clients":null}`,
+		`{"game":"x",}`,
+		``,
+	}, GameServersIn...)
+
+	for _, body := range bodies {
+
+		var expected GameServer
+		expectedErr := json.NewDecoder(strings.NewReader(body)).Decode(&expected)
+
+		if expectedErr == nil {
+			expectedErr = binding.Validator.ValidateStruct(&expected)
+		}
+
+		decoded, err := decodeGameServer(strings.NewReader(body))
+
+		if fmt.Sprint(err) != fmt.Sprint(expectedErr) || fmt.Sprintf("%#v", decoded) != fmt.Sprintf("%#v", expected) {
+			t.Errorf("%s: expecting %#v (%v), decoded %#v (%v)", body, expected, expectedErr, decoded, err)
+		}
+	}
+}
+
+func TestToGameServerSliceGroupsRows(t *testing.T) {
+
+	rows := GameServerClientSlice{
+		{Serverurl: "tcp://a", Game: "A", Curplayers: 1, Client_platform: "atari", Client_url: "tnfs://a/1"},
+		{Serverurl: "tcp://a", Game: "A", Curplayers: 1, Client_platform: "c64", Client_url: "tnfs://a/2"},
+		{Serverurl: "tcp://b", Game: "B", Curplayers: 3, Client_platform: "atari", Client_url: "tnfs://b/1"},
+	}
+
+	servers := rows.toGameServerSlice()
+
+	if len(servers) != 2 || servers[0].Serverurl != "tcp://b" || len(servers[0].Clients) != 1 || len(servers[1].Clients) != 2 {
+		t.Fatalf("expecting tcp://b with 1 client then tcp://a with 2, received %+v", servers)
+	}
+
+	// clients of a server share an array with the next one, but never overwrite it
+	servers[1].Clients = append(servers[1].Clients, GameClient{Platform: "coco"})
+
+	if servers[0].Clients[0].Platform != "atari" {
+		t.Errorf("appending to the clients of a server changed another server: %+v", servers[0].Clients)
+	}
+}
+
+func TestCheckInput(t *testing.T) {
+
+	server := GameServer{
+		Game:       "fujitzee",
+		Appkey:     1,
+		Region:     "us",
+		Server:     "fujitzee server",
+		Serverurl:  "tcp://fujitzee.lobby.example:6502",
+		Curplayers: 1,
+		Maxplayers: 4,
+		Clients:    []GameClient{{Platform: "atari", Url: "tnfs://tnfs.fujinet.online/ATARI/fujitzee.xex"}},
+	}
+
+	if allocs := testing.AllocsPerRun(100, func() {
+		if err := server.CheckInput(); err != nil {
+			t.Fatal(err)
+		}
+	}); allocs != 0 {
+		t.Errorf("expecting no allocations for a valid server, received %v", allocs)
+	}
+
+	server.Game = "f"
+	server.Curplayers = 5
+	server.Clients = append(server.Clients, GameClient{Platform: "c64", Url: "not a url"})
+
+	expected := "key: 'GameServer.Curplayers' and 'GameServer.Maxplayers' Error:Field validation for 'Curplayers' (5) cannot be bigger than 'Maxplayers' (4)\n" +
+		"key: 'GameServer.Game' Error: Field validation length must be between 2 and 16 characters\n" +
+		"key: 'GameServer.ServerUrl' Error: Field validation has to be a valid url"
+
+	if err := server.CheckInput(); err == nil || err.Error() != expected {
+		t.Errorf("expecting\n%s\nreceived\n%v", expected, err)
+	}
+
+	// anything the fast path turns down is still left to url.ParseRequestURI
+	for uri, invalid := range map[string]bool{
+		"tcp://host:6502":        false,
+		"http://[::1]:8080/":     false,
+		"http://host/a%20b":      false,
+		"http://user@host/":      false,
+		"/relative":              false,
+		"host:6502":              false,
+		"not a url":              true,
+		"http://host/a%zz":       true,
+		"http://host:port/":      true,
+		"tnfs://host/path?q=a b": false,
+	} {
+		if IsValidURI(uri) != invalid {
+			t.Errorf("IsValidURI(%q) expecting %v", uri, invalid)
+		}
+	}
+}
+
+func TestRoutersSendTheSameResponses(t *testing.T) {
+
+	routers := map[string]http.Handler{
+		ROUTER_GIN: newRouter(ROUTER_GIN, gin.New()),
+		ROUTER_MUX: newRouter(ROUTER_MUX, gin.New()),
+	}
+
+	for _, ServerJson := range GameServersIn {
+		w := httptest.NewRecorder()
+		req, _ := http.NewRequest("POST", "/server", bytes.NewBuffer([]byte(ServerJson)))
+		ROUTER.ServeHTTP(w, req)
+	}
+
+	requests := []struct {
+		method string
+		uri    string
+		body   string
+		header string // Accept-Encoding
+	}{
+		{"GET", "/", "", ""},
+		{"GET", "/", "", "gzip"},
+		{"GET", "/docs", "", "gzip"},
+		{"GET", "/viewFull", "", ""},
+		{"GET", "/view?platform=atari&pagesize=2", "", ""},
+		{"GET", "/view?platform=atari&bin=1", "", ""},
+		{"GET", "/view?platform=nowhere", "", ""},
+		{"GET", "/view", "", ""},
+		{"POST", "/server", "", ""},
+		{"POST", "/server", `{"game":"x"}`, ""},
+		{"POST", "/server", GameServersIn[0], ""},
+		{"DELETE", "/server", `{"serverurl":"not a url"}`, ""},
+		{"DELETE", "/server", `{"serverurl":"tcp://nowhere.example/"}`, ""},
+		{"PUT", "/view", "", ""},
+		{"GET", "/nowhere", "", ""},
+	}
+
+	for _, r := range requests {
+
+		recorded := map[string]*httptest.ResponseRecorder{}
+
+		for kind, router := range routers {
+			req, _ := http.NewRequest(r.method, r.uri, strings.NewReader(r.body))
+			req.Header.Set("Accept-Encoding", r.header)
+
+			recorded[kind] = httptest.NewRecorder()
+			router.ServeHTTP(recorded[kind], req)
+		}
+
+		g, m := recorded[ROUTER_GIN], recorded[ROUTER_MUX]
+
+		if g.Code != m.Code || !bytes.Equal(g.Body.Bytes(), m.Body.Bytes()) {
+			t.Errorf("%s %s: gin sent HTTP %d %q, mux sent HTTP %d %q", r.method, r.uri, g.Code, g.Body.String(), m.Code, m.Body.String())
+		}
+
+		for _, header := range []string{"Content-Type", "Content-Encoding", "Vary", "ETag", "Cache-Control"} {
+			if g.Header().Get(header) != m.Header().Get(header) {
+				t.Errorf("%s %s: gin sent %s '%s', mux sent '%s'", r.method, r.uri, header, g.Header().Get(header), m.Header().Get(header))
+			}
+		}
+	}
+
+	w := httptest.NewRecorder()
+	req, _ := http.NewRequest("GET", "/version", nil)
+	routers[ROUTER_MUX].ServeHTTP(w, req)
+
+	if w.Code != 200 || !strings.Contains(w.Body.String(), STRINGVER) {
+		t.Errorf("%s %s expecting HTTP 200 with the version, received HTTP %d", req.Method, req.URL.Path, w.Code)
+	}
+}
+
+func TestHTTPServerLimits(t *testing.T) {
+
+	server := newHTTPServer(ROUTER, httpOptions{MaxBodyBytes: 1024, KeepAlive: true})
+
+	for _, method := range []string{"POST", "DELETE"} {
+
+		w := httptest.NewRecorder()
+		body := `{"serverurl":"http://` + strings.Repeat("a", 2048) + `"}`
+		req, _ := http.NewRequest(method, "/server", strings.NewReader(body))
+		server.Handler.ServeHTTP(w, req)
+
+		if w.Code != http.StatusRequestEntityTooLarge {
+			t.Errorf("%s %s with a %d bytes body expecting HTTP 413, received HTTP %d", method, req.URL.Path, len(body), w.Code)
+		}
+	}
+
+	if runtime.GOOS != "linux" {
+		return
+	}
+
+	listeners, err := listen("127.0.0.1:0", 2)
+
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	for _, listener := range listeners {
+		listener.Close()
+	}
+
+	if len(listeners) != 2 || listeners[0].Addr().String() != listeners[1].Addr().String() {
+		t.Errorf("expecting 2 listeners on the same address, received %v", listeners)
+	}
+}
+
+func TestRateLimiter(t *testing.T) {
+
+	limiter := newRateLimiter(rateOptions{ReadRate: 1, ReadBurst: 2, WriteRate: 1, WriteBurst: 1})
+	handler := limiter.Wrap(ROUTER)
+
+	send := func(method string, uri string, body string, remoteAddr string) *httptest.ResponseRecorder {
+		w := httptest.NewRecorder()
+		req := httptest.NewRequest(method, uri, strings.NewReader(body))
+		req.RemoteAddr = remoteAddr
+		handler.ServeHTTP(w, req)
+		return w
+	}
+
+	for i, expected := range []int{200, 200, 429} {
+		if w := send("GET", "/version", "", "192.0.2.1:1234"); w.Code != expected {
+			t.Errorf("GET /version #%d expecting HTTP %d, received HTTP %d", i+1, expected, w.Code)
+		}
+	}
+
+	if w := send("GET", "/version", "", "192.0.2.1:1234"); w.Header().Get("Retry-After") != "1" {
+		t.Errorf("expecting Retry-After 1 on HTTP 429, received '%s'", w.Header().Get("Retry-After"))
+	}
+
+	// heartbeats have their own budget, other clients their own buckets
+	if w := send("POST", "/server", GameServersIn[0], "192.0.2.1:1234"); w.Code != 201 {
+		t.Errorf("POST /server expecting HTTP 201 from a client over its read limit, received HTTP %d", w.Code)
+	}
+
+	if w := send("GET", "/version", "", "192.0.2.2:1234"); w.Code != 200 {
+		t.Errorf("GET /version expecting HTTP 200 from another client, received HTTP %d", w.Code)
+	}
+
+	// an IPv6 client gets a /64
+	send("GET", "/version", "", "[2001:db8::1]:1234")
+	send("GET", "/version", "", "[2001:db8::2]:1234")
+
+	if w := send("GET", "/version", "", "[2001:db8::3]:1234"); w.Code != 429 {
+		t.Errorf("GET /version expecting HTTP 429 from the same /64, received HTTP %d", w.Code)
+	}
+
+	limiter.Evict(time.Now().Add(time.Hour))
+
+	for i := range limiter.shards {
+		if len(limiter.shards[i].buckets) > 0 {
+			t.Fatalf("expecting every idle bucket evicted, shard %d has %d", i, len(limiter.shards[i].buckets))
+		}
+	}
+}
+
+func TestRateLimiterShedsReadsFirst(t *testing.T) {
+
+	limiter := newRateLimiter(rateOptions{MaxReads: 1})
+
+	started := make(chan struct{})
+	release := make(chan struct{})
+
+	handler := limiter.Wrap(http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		if r.Method == "GET" {
+			close(started)
+			<-release
+		}
+	}))
+
+	var wg sync.WaitGroup
+	wg.Add(1)
+
+	go func() {
+		defer wg.Done()
+		handler.ServeHTTP(httptest.NewRecorder(), httptest.NewRequest("GET", "/viewFull", nil))
+	}()
+
+	<-started
+
+	w := httptest.NewRecorder()
+	handler.ServeHTTP(w, httptest.NewRequest("GET", "/view?platform=atari", nil))
+
+	if w.Code != 429 {
+		t.Errorf("GET /view expecting HTTP 429 over the reads in flight, received HTTP %d", w.Code)
+	}
+
+	w = httptest.NewRecorder()
+	handler.ServeHTTP(w, httptest.NewRequest("POST", "/server", nil))
+
+	if w.Code != 200 {
+		t.Errorf("POST /server expecting to go through while reads are shed, received HTTP %d", w.Code)
+	}
+
+	close(release)
+	wg.Wait()
+
+	if limiter.reads.Load() != 0 {
+		t.Errorf("expecting no reads in flight, received %d", limiter.reads.Load())
+	}
+}
+
+func TestLogRing(t *testing.T) {
+
+	ring := newLogRing(8)
+
+	// the writer isn't running yet: the ring fills up and the rest is dropped
+	for i := 0; i < 10; i++ {
+		line := logLines.Get().(*[]byte)
+		*line = fmt.Appendf((*line)[:0], "line %d", i)
+		ring.push(line)
+	}
+
+	var out bytes.Buffer
+
+	ring.start(&out)
+	ring.Flush(time.Second)
+
+	expected := "line 0\nline 1\nline 2\nline 3\nline 4\nline 5\nline 6\nline 7\n" +
+		"LOGGER: 2 log lines dropped, the log writer couldn't keep up\n"
+
+	if out.String() != expected {
+		t.Errorf("log ring expecting\n%s\nreceived\n%s", expected, out.String())
+	}
+
+	if ring.lost.Load() != 2 {
+		t.Errorf("log ring expecting 2 lines lost, received %d", ring.lost.Load())
+	}
+}
+
+func TestCustomLogger(t *testing.T) {
+
+	saved := LOGRING
+	LOGRING = newLogRing(16)
+	defer func() { LOGRING = saved }()
+
+	var out bytes.Buffer
+	LOGRING.start(&out)
+
+	logger := CustomLogger{name: "test", prefix: "TEST: ", on: true}
+
+	logger.Printw("request", "method", "GET", "path", "/view", "status", 200, "duration", 1500*time.Microsecond, "client", "")
+	logger.Printf("%d servers", 3)
+
+	func() { logger.CallerPrintf("error: %s", "busy") }()
+
+	LOGRING.Flush(time.Second)
+
+	expected := "TEST: request method=GET path=/view status=200 duration=1.5ms client=\"\"\n" +
+		"TEST: 3 servers\n" +
+		"TEST: TestCustomLogger/TestCustomLogger error: busy\n"
+
+	if out.String() != expected {
+		t.Errorf("logger expecting\n%s\nreceived\n%s", expected, out.String())
+	}
+
+	logger.SetActive(false)
+
+	allocs := testing.AllocsPerRun(100, func() {
+		logger.Printf("%s", "off")
+		logger.CallerPrintf("%s", "off")
+		logger.Printw("off", "key", "value")
+	})
+
+	if allocs != 0 {
+		t.Errorf("disabled logger expecting no allocations, received %v", allocs)
+	}
+
+	logger.SetActive(true)
+
+	for _, test := range []struct{ sampling, expected int }{{1, 100}, {4, 25}, {0, 0}} {
+
+		logger.SetSampling(test.sampling)
+		sampled := 0
+
+		for i := 0; i < 100; i++ {
+			if logger.Sample() {
+				sampled++
+			}
+		}
+
+		if sampled != test.expected {
+			t.Errorf("logger sampling 1 in %d expecting %d of 100 calls, received %d", test.sampling, test.expected, sampled)
+		}
+	}
+}
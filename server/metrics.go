@@ -0,0 +1,445 @@
+package main
+
+import (
+	"bytes"
+	"errors"
+	"fmt"
+	"net/http"
+	"runtime"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/gin-gonic/gin"
+	"github.com/mattn/go-sqlite3"
+)
+
+// Counters and latency histograms served on /metrics in the Prometheus text
+// format (https://prometheus.io/docs/instrumenting/exposition_formats/).
+//
+// Requests are measured by MetricsMiddleware per route, method and response
+// format, and every database function in tx.go measures its own time, so a slow
+// /view can be told apart between SQL, rendering and the network. Gauges (queue
+// depth, registry size, Go runtime) are read when /metrics is scraped.
+type metrics struct {
+	mu       sync.RWMutex
+	requests map[requestKey]*atomic.Uint64 // by route, method, format and status code
+	latency  map[requestKey]*histogram     // by route, method and format
+	queries  map[string]*histogram         // by tx.go function
+
+	dbErrors  atomic.Uint64
+	dbBusy    atomic.Uint64 // SQLITE_BUSY and SQLITE_LOCKED errors, and checkpoints blocked by readers
+	dbRetries atomic.Uint64 // writes retried one by one after their batch failed
+}
+
+type requestKey struct {
+	route  string
+	method string
+	format string // bin or json
+	code   int    // 0 for the latency histograms
+}
+
+// Latency buckets in seconds, from a cached /view to a slow transaction
+var LATENCY_BUCKETS = [...]float64{0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5}
+
+type histogram struct {
+	counts [len(LATENCY_BUCKETS) + 1]atomic.Uint64 // one per LATENCY_BUCKETS, then +Inf. Not cumulative.
+	sum    atomic.Int64                            // nanoseconds
+}
+
+var METRICS = metrics{
+	requests: make(map[requestKey]*atomic.Uint64),
+	latency:  make(map[requestKey]*histogram),
+	queries:  make(map[string]*histogram),
+}
+
+func (h *histogram) Observe(elapsed time.Duration) {
+
+	seconds := elapsed.Seconds()
+	i := sort.SearchFloat64s(LATENCY_BUCKETS[:], seconds)
+
+	h.counts[i].Add(1)
+	h.sum.Add(int64(elapsed))
+}
+
+// entry of m for key, created if needed. Lookups after the first one only take the read lock.
+func metricFor[K comparable, V any](mu *sync.RWMutex, m map[K]*V, key K) *V {
+
+	mu.RLock()
+	value := m[key]
+	mu.RUnlock()
+
+	if value != nil {
+		return value
+	}
+
+	mu.Lock()
+	defer mu.Unlock()
+
+	if value = m[key]; value == nil {
+		value = new(V)
+		m[key] = value
+	}
+
+	return value
+}
+
+// gin middleware measuring every request
+func MetricsMiddleware(c *gin.Context) {
+
+	start := time.Now()
+
+	c.Next()
+
+	key := requestKey{
+		route:  c.FullPath(),
+		method: methodLabel(c.Request.Method),
+		format: IfElse(c.Query("bin") == "1", "bin", "json"),
+	}
+
+	if len(key.route) == 0 {
+		key.route = "unmatched" // don't let 404s create a series per path
+	}
+
+	observeRequest(c.Request, key, start, c.Writer.Status())
+}
+
+// Method label of a request: clients can send any token as a method, and every
+// new one would be a series on /metrics that is never dropped
+func methodLabel(method string) string {
+
+	switch method {
+	case http.MethodGet, http.MethodHead, http.MethodPost, http.MethodPut, http.MethodDelete, http.MethodOptions, http.MethodPatch:
+		return method
+	}
+
+	return "other"
+}
+
+// measure and log a request
+func observeRequest(r *http.Request, key requestKey, start time.Time, code int) {
+
+	elapsed := time.Since(start)
+
+	metricFor(&METRICS.mu, METRICS.latency, key).Observe(elapsed)
+
+	key.code = code
+	metricFor(&METRICS.mu, METRICS.requests, key).Add(1)
+
+	logAccess(r, code, elapsed)
+}
+
+// MetricsMiddleware for the net/http handlers of the mux router
+func measured(route string, handler http.HandlerFunc) http.HandlerFunc {
+
+	return func(w http.ResponseWriter, r *http.Request) {
+
+		start := time.Now()
+
+		sw := statusWriters.Get().(*statusWriter)
+		sw.ResponseWriter, sw.status = w, 0
+
+		handler(sw, r)
+
+		key := requestKey{
+			route:  route,
+			method: methodLabel(r.Method),
+			format: IfElse(queryValue(r.URL.RawQuery, "bin") == "1", "bin", "json"),
+		}
+
+		observeRequest(r, key, start, IfElse(sw.status == 0, http.StatusOK, sw.status))
+
+		sw.ResponseWriter = nil
+		statusWriters.Put(sw)
+	}
+}
+
+// http.ResponseWriter keeping the status code sent, pooled by measured
+type statusWriter struct {
+	http.ResponseWriter
+	status int
+}
+
+var statusWriters = sync.Pool{New: func() any { return new(statusWriter) }}
+
+func (w *statusWriter) WriteHeader(code int) {
+
+	if w.status == 0 {
+		w.status = code
+	}
+
+	w.ResponseWriter.WriteHeader(code)
+}
+
+func (w *statusWriter) Write(b []byte) (int, error) {
+
+	if w.status == 0 {
+		w.status = http.StatusOK
+	}
+
+	return w.ResponseWriter.Write(b)
+}
+
+// Time spent by a database function, and its error if any. Used as
+//
+//	defer observeQuery("txGameServerGetAll", time.Now(), &err)
+//
+// so err is read when the function returns.
+func observeQuery(function string, start time.Time, err *error) {
+
+	metricFor(&METRICS.mu, METRICS.queries, function).Observe(time.Since(start))
+
+	if *err != nil {
+		METRICS.dbErrors.Add(1)
+
+		var sqliteErr sqlite3.Error
+
+		if errors.As(*err, &sqliteErr) && (sqliteErr.Code == sqlite3.ErrBusy || sqliteErr.Code == sqlite3.ErrLocked) {
+			METRICS.dbBusy.Add(1)
+		}
+	}
+}
+
+// metrics in the Prometheus text format
+func ShowMetrics(c *gin.Context) {
+
+	var buf bytes.Buffer
+
+	METRICS.writeTo(&buf)
+
+	c.Data(http.StatusOK, "text/plain; version=0.0.4; charset=utf-8", buf.Bytes())
+}
+
+func (m *metrics) writeTo(buf *bytes.Buffer) {
+
+	m.mu.RLock()
+
+	requests := sortedKeys(m.requests, lessRequestKey)
+	latency := sortedKeys(m.latency, lessRequestKey)
+	queries := sortedKeys(m.queries, func(a, b string) bool { return a < b })
+
+	metricHeader(buf, "lobby_http_requests_total", "counter", "HTTP requests by route, method, response format and status code")
+	for _, key := range requests {
+		fmt.Fprintf(buf, "lobby_http_requests_total{route=%s,method=%s,format=%s,code=\"%d\"} %d\n", labelValue(key.route), labelValue(key.method), labelValue(key.format), key.code, m.requests[key].Load())
+	}
+
+	metricHeader(buf, "lobby_http_request_duration_seconds", "histogram", "HTTP request latency by route, method and response format")
+	for _, key := range latency {
+		m.latency[key].writeTo(buf, "lobby_http_request_duration_seconds", fmt.Sprintf("route=%s,method=%s,format=%s", labelValue(key.route), labelValue(key.method), labelValue(key.format)))
+	}
+
+	metricHeader(buf, "lobby_db_query_duration_seconds", "histogram", "time spent in each database function")
+	for _, function := range queries {
+		m.queries[function].writeTo(buf, "lobby_db_query_duration_seconds", "function="+labelValue(function))
+	}
+
+	m.mu.RUnlock()
+
+	metricHeader(buf, "lobby_db_errors_total", "counter", "database functions that returned an error")
+	fmt.Fprintf(buf, "lobby_db_errors_total %d\n", m.dbErrors.Load())
+
+	metricHeader(buf, "lobby_db_busy_total", "counter", "database errors caused by a busy or locked database, and WAL checkpoints blocked by readers")
+	fmt.Fprintf(buf, "lobby_db_busy_total %d\n", m.dbBusy.Load())
+
+	metricHeader(buf, "lobby_db_tx_retries_total", "counter", "writes retried in their own transaction after their batch failed")
+	fmt.Fprintf(buf, "lobby_db_tx_retries_total %d\n", m.dbRetries.Load())
+
+	metricHeader(buf, "lobby_log_dropped_total", "counter", "log lines dropped because the log writer couldn't keep up")
+	fmt.Fprintf(buf, "lobby_log_dropped_total %d\n", LOGRING.lost.Load())
+
+	writeWebhookMetrics(buf)
+	writeRateLimitMetrics(buf)
+	writeRegistryMetrics(buf)
+	writeRuntimeMetrics(buf)
+}
+
+func writeWebhookMetrics(buf *bytes.Buffer) {
+
+	metricHeader(buf, "lobby_webhook_queue_depth", "gauge", "updates waiting to be sent, per webhook")
+	for _, target := range WEBHOOKS.targets {
+		target.mu.Lock()
+		fmt.Fprintf(buf, "lobby_webhook_queue_depth{%s} %d\n", target.labels(), len(target.order))
+		target.mu.Unlock()
+	}
+
+	counters := []struct {
+		name  string
+		help  string
+		value func(t *webhookTarget) uint64
+	}{
+		{"lobby_webhook_delivered_total", "updates delivered, per webhook", func(t *webhookTarget) uint64 { return t.delivered.Load() }},
+		{"lobby_webhook_retries_total", "delivery attempts retried, per webhook", func(t *webhookTarget) uint64 { return t.retried.Load() }},
+		{"lobby_webhook_failures_total", "updates dropped because the queue was full or every retry failed, per webhook", func(t *webhookTarget) uint64 { return t.deadletters.Load() }},
+	}
+
+	for _, counter := range counters {
+		metricHeader(buf, counter.name, "counter", counter.help)
+		for _, target := range WEBHOOKS.targets {
+			fmt.Fprintf(buf, "%s{%s} %d\n", counter.name, target.labels(), counter.value(target))
+		}
+	}
+
+	metricHeader(buf, "lobby_webhook_unchanged_total", "counter", "heartbeats not sent because the server didn't change")
+	fmt.Fprintf(buf, "lobby_webhook_unchanged_total %d\n", WEBHOOKS.unchanged.Load())
+}
+
+// labels of a webhook on /metrics: its index and its host, as in the logs
+func (t *webhookTarget) labels() string {
+	return "webhook=\"" + strconv.Itoa(t.index) + "\",host=" + labelValue(t.host)
+}
+
+func writeRateLimitMetrics(buf *bytes.Buffer) {
+
+	if RATELIMITER == nil {
+		return
+	}
+
+	metricHeader(buf, "lobby_ratelimit_rejected_total", "counter", "requests answered 429, by class and reason")
+	for i := range RATELIMITER.classes {
+		class := &RATELIMITER.classes[i]
+		fmt.Fprintf(buf, "lobby_ratelimit_rejected_total{class=%s,reason=\"rate\"} %d\n", labelValue(class.name), class.limited.Load())
+	}
+	fmt.Fprintf(buf, "lobby_ratelimit_rejected_total{class=\"read\",reason=\"overload\"} %d\n", RATELIMITER.shed.Load())
+
+	metricHeader(buf, "lobby_ratelimit_reads_in_flight", "gauge", "reads being served, capped by -maxreads")
+	fmt.Fprintf(buf, "lobby_ratelimit_reads_in_flight %d\n", RATELIMITER.reads.Load())
+}
+
+func writeRegistryMetrics(buf *bytes.Buffer) {
+
+	snap := REGISTRY.Snapshot()
+
+	metricHeader(buf, "lobby_registry_generation", "gauge", "generation of the current registry snapshot")
+	fmt.Fprintf(buf, "lobby_registry_generation %d\n", snap.generation)
+
+	metricHeader(buf, "lobby_registry_clients", "gauge", "server clients in the registry, per platform")
+	rowsByPlatform, _ := snap.byPlatform()
+	writePlatformMetrics(buf, rowsByPlatform)
+}
+
+func writePlatformMetrics(buf *bytes.Buffer, rowsByPlatform map[string][]int) {
+
+	// platform names come from the game servers: the METRICS_PLATFORMS biggest
+	// get their own series and the rest add up in "other", so a game server can't
+	// create series at will
+	platforms := sortedKeys(rowsByPlatform, func(a, b string) bool {
+		if na, nb := len(rowsByPlatform[a]), len(rowsByPlatform[b]); na != nb {
+			return na > nb
+		}
+		return a < b
+	})
+
+	other, series := 0, 0
+
+	for _, platform := range platforms {
+
+		if series >= METRICS_PLATFORMS || platform == METRICS_OTHER {
+			other += len(rowsByPlatform[platform])
+			continue
+		}
+
+		series++
+		fmt.Fprintf(buf, "lobby_registry_clients{platform=%s} %d\n", labelValue(platform), len(rowsByPlatform[platform]))
+	}
+
+	if other > 0 {
+		fmt.Fprintf(buf, "lobby_registry_clients{platform=%s} %d\n", labelValue(METRICS_OTHER), other)
+	}
+}
+
+func writeRuntimeMetrics(buf *bytes.Buffer) {
+
+	var mem runtime.MemStats
+	runtime.ReadMemStats(&mem)
+
+	gauges := []struct {
+		name  string
+		kind  string
+		help  string
+		value float64
+	}{
+		{"go_goroutines", "gauge", "number of goroutines", float64(runtime.NumGoroutine())},
+		{"go_memstats_heap_alloc_bytes", "gauge", "bytes of allocated heap objects", float64(mem.HeapAlloc)},
+		{"go_memstats_heap_objects", "gauge", "number of allocated heap objects", float64(mem.HeapObjects)},
+		{"go_memstats_sys_bytes", "gauge", "bytes obtained from the OS", float64(mem.Sys)},
+		{"go_memstats_mallocs_total", "counter", "heap objects allocated", float64(mem.Mallocs)},
+		{"go_memstats_alloc_bytes_total", "counter", "bytes allocated for heap objects", float64(mem.TotalAlloc)},
+		{"go_gc_cycles_total", "counter", "completed GC cycles", float64(mem.NumGC)},
+		{"go_gc_pause_seconds_total", "counter", "stop-the-world GC pause time", float64(mem.PauseTotalNs) / 1e9},
+		{"process_uptime_seconds", "gauge", "seconds since the server started", time.Since(STARTEDON).Seconds()},
+	}
+
+	for _, gauge := range gauges {
+		metricHeader(buf, gauge.name, gauge.kind, gauge.help)
+		fmt.Fprintf(buf, "%s %s\n", gauge.name, strconv.FormatFloat(gauge.value, 'g', -1, 64))
+	}
+}
+
+const (
+	METRICS_PLATFORMS = 32      // platforms with their own lobby_registry_clients series
+	METRICS_OTHER     = "other" // platform label of the rest
+)
+
+// Quoted label value as the exposition format wants it: only backslash, double
+// quote and line feed are escaped. %q would escape control and non-ASCII bytes
+// as \x.. and \u...., which Prometheus doesn't read back.
+func labelValue(value string) string {
+	return `"` + labelEscaper.Replace(value) + `"`
+}
+
+var labelEscaper = strings.NewReplacer(`\`, `\\`, `"`, `\"`, "\n", `\n`)
+
+// cumulative buckets, sum and count of h with labels
+func (h *histogram) writeTo(buf *bytes.Buffer, name string, labels string) {
+
+	var count uint64
+
+	for i := range h.counts {
+
+		count += h.counts[i].Load()
+		le := "+Inf"
+
+		if i < len(LATENCY_BUCKETS) {
+			le = strconv.FormatFloat(LATENCY_BUCKETS[i], 'g', -1, 64)
+		}
+
+		fmt.Fprintf(buf, "%s_bucket{%s,le=%q} %d\n", name, labels, le, count)
+	}
+
+	fmt.Fprintf(buf, "%s_sum{%s} %s\n", name, labels, strconv.FormatFloat(time.Duration(h.sum.Load()).Seconds(), 'g', -1, 64))
+	fmt.Fprintf(buf, "%s_count{%s} %d\n", name, labels, count)
+}
+
+func metricHeader(buf *bytes.Buffer, name string, kind string, help string) {
+	fmt.Fprintf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, kind)
+}
+
+func sortedKeys[K comparable, V any](m map[K]V, less func(a, b K) bool) []K {
+
+	keys := make([]K, 0, len(m))
+
+	for key := range m {
+		keys = append(keys, key)
+	}
+
+	sort.Slice(keys, func(i, j int) bool { return less(keys[i], keys[j]) })
+
+	return keys
+}
+
+func lessRequestKey(a, b requestKey) bool {
+
+	switch {
+	case a.route != b.route:
+		return a.route < b.route
+	case a.method != b.method:
+		return a.method < b.method
+	case a.format != b.format:
+		return a.format < b.format
+	}
+
+	return a.code < b.code
+}
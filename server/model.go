@@ -1,8 +1,6 @@
 package main
 
 import (
-	"errors"
-	"fmt"
 	"sort"
 	"time"
 )
@@ -65,8 +63,15 @@ type GameServerMin struct {
 	Pingage    int    `json:"a"`
 }
 
-// minimize file to send to 8 bit client filtering by platform
-func (s GameServerClient) Minimize() (minimised GameServerMin) {
+// json envelope for /view when the client paginates with after=
+type GameServerMinPage struct {
+	Servers []GameServerMin `json:"servers"`
+	Next    string          `json:"next"` // cursor for the next page, "" if there are no more
+}
+
+// minimize file to send to 8 bit client filtering by platform. now is read
+// once per request, not per row.
+func (s *GameServerClient) Minimize(now time.Time) (minimised GameServerMin) {
 
 	return GameServerMin{
 		Game:       s.Game,
@@ -78,43 +83,72 @@ func (s GameServerClient) Minimize() (minimised GameServerMin) {
 		Online:     IfElse(s.Status == "online", 1, 0),
 		Maxplayers: s.Maxplayers,
 		Curplayers: s.Curplayers,
-		Pingage:    int(time.Since(s.Lastping).Seconds()),
+		Pingage:    int(now.Sub(s.Lastping).Seconds()),
 	}
 }
 
-// conver a flat GameServerClient to a nested GameServer
-func (s GameServerClient) toGameServer() (gameserver GameServer) {
-	return GameServer{
-		Game:       s.Game,
-		Appkey:     s.Appkey,
-		Server:     s.Server,
-		Region:     s.Region,
-		Serverurl:  s.Serverurl,
-		Status:     s.Status,
-		Maxplayers: s.Maxplayers,
-		Curplayers: s.Curplayers,
-		Clients:    []GameClient{{Platform: s.Client_platform, Url: s.Client_url}},
+// flatten a GameServer into the GameServerClient row of one of its clients
+func (s GameServer) toGameServerClient(client GameClient, lastping time.Time) GameServerClient {
+	return GameServerClient{
+		Serverurl:       s.Serverurl,
+		Game:            s.Game,
+		Appkey:          s.Appkey,
+		Server:          s.Server,
+		Region:          s.Region,
+		Status:          s.Status,
+		Maxplayers:      s.Maxplayers,
+		Curplayers:      s.Curplayers,
+		Lastping:        lastping,
+		Client_platform: client.Platform,
+		Client_url:      client.Url,
 	}
 }
 
-// transform a flat GameServerClientSlice to nested GameServerSlice
+// Transform a flat GameServerClientSlice to nested GameServerSlice. Rows of a
+// server are contiguous, so servers are grouped in a single pass. The servers
+// and all their clients take one allocation each: every server's Clients is a
+// window of a shared array, capped so appending to it never overwrites the next.
 func (s GameServerClientSlice) toGameServerSlice() (gameservers GameServerSlice) {
 
-	var prev GameServer
-	i := -1
+	if len(s) == 0 {
+		return nil
+	}
 
-	for _, gsc := range s {
+	count := 1
 
-		current := gsc.toGameServer()
+	for i := 1; i < len(s); i++ {
+		if s[i].Serverurl != s[i-1].Serverurl {
+			count++
+		}
+	}
+
+	gameservers = make(GameServerSlice, 0, count)
+	clients := make([]GameClient, len(s))
+	first := 0
+
+	for i := range s {
 
-		if prev.Serverurl == current.Serverurl {
-			gameservers[i].Clients = append(gameservers[i].Clients, current.Clients...)
-		} else {
-			i++
-			gameservers = append(gameservers, current)
+		gsc := &s[i]
+		clients[i] = GameClient{Platform: gsc.Client_platform, Url: gsc.Client_url}
+
+		if i+1 < len(s) && s[i+1].Serverurl == gsc.Serverurl {
+			continue
 		}
 
-		prev = current
+		// last row of the server
+		gameservers = append(gameservers, GameServer{
+			Game:       gsc.Game,
+			Appkey:     gsc.Appkey,
+			Server:     gsc.Server,
+			Region:     gsc.Region,
+			Serverurl:  gsc.Serverurl,
+			Status:     gsc.Status,
+			Maxplayers: gsc.Maxplayers,
+			Curplayers: gsc.Curplayers,
+			Clients:    clients[first : i+1 : i+1],
+		})
+
+		first = i + 1
 	}
 
 	// Sort the ranks by online people at the top
@@ -125,6 +159,9 @@ func (s GameServerClientSlice) toGameServerSlice() (gameservers GameServerSlice)
 	return gameservers
 }
 
+// size of a GameServerMin in binary format: appkey, 5 fixed length strings (+1 terminator each), online, players and ping age
+const BINARY_SERVER_SIZE = 1 + (16 + 1) + (32 + 1) + (64 + 1) + (64 + 1) + (2 + 1) + 3 + 2
+
 // Return minimized result to binary format to optimize 8-bit consumption
 func (s GameServerMin) appendAsBinary(buf []byte) []byte {
 	buf = append(buf, byte(s.AppKey))
@@ -146,38 +183,18 @@ func (s GameServerMin) appendAsBinary(buf []byte) []byte {
 	return buf
 }
 
-// Do additional checking
+// Do additional checking, see validate.go
 func (s *GameServer) CheckInput() (err error) {
 
-	err = errors.Join(
-		ErrorIf(s.Curplayers < 0, fmt.Errorf("key: 'GameServer.Curplayers' Error:Field validation for 'Curplayers' cannot be negative (%d)", s.Curplayers)),
-		ErrorIf(s.Maxplayers < 0, fmt.Errorf("key: 'GameServer.Maxplayers' Error:Field validation for 'Maxplayers' cannot be negative (%d)", s.Maxplayers)),
-		ErrorIf(s.Curplayers > s.Maxplayers, fmt.Errorf("key: 'GameServer.Curplayers' and 'GameServer.Maxplayers' Error:Field validation for 'Curplayers' (%d) cannot be bigger than 'Maxplayers' (%d)", s.Curplayers, s.Maxplayers)),
-		ErrorIf(s.Appkey < 1 || s.Appkey > 255, fmt.Errorf("key: 'GameServer.Appkey' Error: Field validation length must be between 1 and 255")),
-		ErrorIf(len(s.Game) < 2 || len(s.Game) > 16, fmt.Errorf("key: 'GameServer.Game' Error: Field validation length must be between 2 and 16 characters")),
-		ErrorIf(len(s.Region) > 2, fmt.Errorf("key: 'GameServer.Region' Error: Field validation length must be 2 or less characters")),
-		ErrorIf(len(s.Server) > 32, fmt.Errorf("key: 'GameServer.Server' Error: Field validation length must be 32 or less characters")),
-		ErrorIf(IsValidURI(s.Serverurl), fmt.Errorf("key: 'GameServer.ServerUrl' Error: Field validation has to be a valid url")),
-		ErrorIf(len(s.Serverurl) > 64, fmt.Errorf("key: 'GameServer.ServerUrl' Error: Field validation length must be 64 or less characters")),
-	)
-
-	for _, client := range s.Clients {
-
-		err = errors.Join(err,
-			ErrorIf(IsValidURI(client.Url), fmt.Errorf("key: 'GameServer.ServerUrl' Error: Field validation has to be a valid url")),
-			ErrorIf(len(client.Url) > 64, fmt.Errorf("key: 'GameServer.ServerUrl' Error: Field validation length must be 64 or less characters")),
-		)
+	err = checkRules(s, GAMESERVER_RULES, nil)
 
+	for i := range s.Clients {
+		err = checkRules(&s.Clients[i], GAMECLIENT_RULES, err)
 	}
 
 	return err
 }
-func (s *GameServerDelete) CheckInput() (err error) {
-
-	err = errors.Join(
-		ErrorIf(IsValidURI(s.Serverurl), fmt.Errorf("key: 'GameServer.ServerUrl' Error: Field validation has to be a valid url")),
-		ErrorIf(len(s.Serverurl) > 64, fmt.Errorf("key: 'GameServer.ServerUrl' Error: Field validation length must be 64 or less characters")),
-	)
 
-	return err
+func (s *GameServerDelete) CheckInput() (err error) {
+	return checkRules(s, GAMESERVERDELETE_RULES, nil)
 }
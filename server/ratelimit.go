@@ -0,0 +1,269 @@
+package main
+
+import (
+	"hash/maphash"
+	"net/http"
+	"net/netip"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/gin-gonic/gin"
+	"github.com/madflojo/tasks"
+)
+
+// Per client rate limits and load shedding, in front of both routers.
+//
+// Every client address gets a token bucket per class of request: heartbeats
+// (POST and DELETE /server) and reads (everything else), each class with its
+// own rate and burst. A bucket is a single atomic value updated without locks;
+// buckets are kept in sharded maps, and buckets that have been idle long enough
+// to be full again are evicted, as they're the same as a new one.
+//
+// On top of that, reads in flight are capped: past the cap reads are turned
+// away while heartbeats go through, so game servers keep their latency when a
+// crawler floods /view. Both answer 429 with Retry-After.
+type rateLimiter struct {
+	classes [RATE_CLASSES]rateClass
+	shards  [RATELIMIT_SHARDS]rateShard
+	seed    maphash.Seed
+
+	realIPHeader string // set by a trusted proxy, "" to use the connection address
+
+	maxReads int64 // 0 for no cap
+	reads    atomic.Int64
+	shed     atomic.Uint64 // reads turned away by the cap
+}
+
+type rateClass struct {
+	name      string
+	interval  int64 // nanoseconds per token, 0 for no limit
+	tolerance int64 // burst * interval
+	limited   atomic.Uint64
+}
+
+type rateShard struct {
+	mu      sync.RWMutex
+	buckets map[rateKey]*rateBucket
+}
+
+type rateKey struct {
+	addr  netip.Addr
+	class int
+}
+
+// Token bucket as a generic cell rate algorithm: instead of a token count and
+// a refill time, the time at which the bucket would be full again (tat,
+// theoretical arrival time). One atomic int64 holds the whole state.
+type rateBucket struct {
+	tat atomic.Int64
+}
+
+// Rates in requests per second per client address, 0 for no limit
+type rateOptions struct {
+	ReadRate     float64
+	ReadBurst    int
+	WriteRate    float64
+	WriteBurst   int
+	MaxReads     int
+	RealIPHeader string
+}
+
+const (
+	RATE_READ = iota
+	RATE_WRITE
+	RATE_CLASSES
+)
+
+const (
+	RATELIMIT_SHARDS = 64
+	RATELIMIT_EVICT  = time.Minute
+)
+
+var RATELIMITER *rateLimiter // nil if every limit is disabled
+
+func init_ratelimit(opts rateOptions) {
+
+	if opts.ReadRate <= 0 && opts.WriteRate <= 0 && opts.MaxReads <= 0 {
+		return
+	}
+
+	RATELIMITER = newRateLimiter(opts)
+
+	SCHEDULER.Add(&tasks.Task{
+		Interval: RATELIMIT_EVICT,
+		TaskFunc: func() error {
+			RATELIMITER.Evict(time.Now())
+			return nil
+		},
+	})
+
+	INFO.Printf("Rate limiting reads to %g/s (burst %d) and heartbeats to %g/s (burst %d) per client, %d reads in flight",
+		opts.ReadRate, opts.ReadBurst, opts.WriteRate, opts.WriteBurst, opts.MaxReads)
+
+	if len(opts.RealIPHeader) == 0 && (opts.ReadRate > 0 || opts.WriteRate > 0) {
+		WARN.Printf("Rate limits apply per connection address: behind a reverse proxy every client shares the proxy's limits, set -realipheader")
+	}
+}
+
+func newRateLimiter(opts rateOptions) *rateLimiter {
+
+	rl := &rateLimiter{
+		seed:         maphash.MakeSeed(),
+		realIPHeader: opts.RealIPHeader,
+		maxReads:     int64(max(opts.MaxReads, 0)),
+	}
+
+	rl.classes[RATE_READ].setRate("read", opts.ReadRate, opts.ReadBurst)
+	rl.classes[RATE_WRITE].setRate("write", opts.WriteRate, opts.WriteBurst)
+
+	for i := range rl.shards {
+		rl.shards[i].buckets = make(map[rateKey]*rateBucket)
+	}
+
+	return rl
+}
+
+func (c *rateClass) setRate(name string, rate float64, burst int) {
+
+	c.name = name
+
+	if rate > 0 {
+		c.interval = int64(float64(time.Second) / rate)
+		c.tolerance = int64(max(burst, 1)) * c.interval
+	}
+}
+
+// handler answering 429 to the requests over the limits, next serves the others
+func (rl *rateLimiter) Wrap(next http.Handler) http.Handler {
+
+	return http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+
+		class := RATE_READ
+
+		if r.URL.Path == "/server" && (r.Method == http.MethodPost || r.Method == http.MethodDelete) {
+			class = RATE_WRITE
+		}
+
+		if wait, ok := rl.Allow(rl.clientAddr(r), class, time.Now()); !ok {
+			rl.classes[class].limited.Add(1)
+			tooManyRequests(w, wait)
+			return
+		}
+
+		// long polls on /events are idle most of the time, they don't count
+		if class == RATE_READ && rl.maxReads > 0 && r.URL.Path != "/events" {
+
+			defer rl.reads.Add(-1)
+
+			if rl.reads.Add(1) > rl.maxReads {
+				rl.shed.Add(1)
+				tooManyRequests(w, time.Second)
+				return
+			}
+		}
+
+		next.ServeHTTP(w, r)
+	})
+}
+
+// Take a token from the bucket of addr for class. If there's none, wait is
+// how long until there is.
+func (rl *rateLimiter) Allow(addr netip.Addr, class int, now time.Time) (wait time.Duration, ok bool) {
+
+	c := &rl.classes[class]
+
+	if c.interval == 0 {
+		return 0, true
+	}
+
+	bucket := rl.bucket(rateKey{addr, class})
+	t := now.UnixNano()
+
+	for {
+		tat := bucket.tat.Load()
+		next := max(tat, t) + c.interval
+
+		if next-t > c.tolerance {
+			return time.Duration(next - t - c.tolerance), false
+		}
+
+		if bucket.tat.CompareAndSwap(tat, next) {
+			return 0, true
+		}
+	}
+}
+
+// bucket for key, created if needed. Lookups after the first one only take the read lock.
+func (rl *rateLimiter) bucket(key rateKey) *rateBucket {
+
+	addr := key.addr.As16()
+	shard := &rl.shards[maphash.Bytes(rl.seed, addr[:])%RATELIMIT_SHARDS]
+
+	return metricFor(&shard.mu, shard.buckets, key)
+}
+
+// drop the buckets that are full again at now
+func (rl *rateLimiter) Evict(now time.Time) {
+
+	t := now.UnixNano()
+
+	for i := range rl.shards {
+
+		shard := &rl.shards[i]
+		shard.mu.Lock()
+
+		for key, bucket := range shard.buckets {
+			if bucket.tat.Load() <= t {
+				delete(shard.buckets, key)
+			}
+		}
+
+		shard.mu.Unlock()
+	}
+}
+
+// Address the limits apply to: the connection's, or the one in realIPHeader
+// (the last one if the proxy appends to a list, as with X-Forwarded-For). IPv6
+// clients get a /64 each, so they can't get around the limits by changing
+// address within their network.
+func (rl *rateLimiter) clientAddr(r *http.Request) netip.Addr {
+
+	var addr netip.Addr
+
+	if len(rl.realIPHeader) > 0 {
+
+		value := r.Header.Get(rl.realIPHeader)
+
+		if i := strings.LastIndexByte(value, ','); i >= 0 {
+			value = value[i+1:]
+		}
+
+		addr, _ = netip.ParseAddr(strings.TrimSpace(value))
+	}
+
+	if !addr.IsValid() {
+		addrport, _ := netip.ParseAddrPort(r.RemoteAddr)
+		addr = addrport.Addr()
+	}
+
+	addr = addr.Unmap()
+
+	if addr.Is6() {
+		prefix, _ := addr.Prefix(64)
+		addr = prefix.Addr()
+	}
+
+	return addr
+}
+
+func tooManyRequests(w http.ResponseWriter, wait time.Duration) {
+
+	// whole seconds, rounded up
+	w.Header().Set("Retry-After", strconv.FormatInt(int64(max((wait+time.Second-1)/time.Second, 1)), 10))
+
+	writeJSON(w, http.StatusTooManyRequests,
+		gin.H{"success": false, "message": "Too many requests, retry later"})
+}
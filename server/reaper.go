@@ -0,0 +1,106 @@
+package main
+
+import (
+	"time"
+
+	"github.com/madflojo/tasks"
+)
+
+// Database maintenance, run by the scheduler outside the request path.
+//
+// Servers that stop sending heartbeats are set offline after offlinettl and
+// deleted after deletettl, in batches of REAPER_BATCH so the writer is never
+// held for long. Both changes go through the registry, so they show up in the
+// snapshot, /events and the webhooks like any other update. The reaper also
+// keeps the query planner statistics up to date and the WAL file small.
+type reaper struct {
+	offlinettl time.Duration // 0 disables it
+	deletettl  time.Duration // 0 disables it
+}
+
+const (
+	REAPER_INTERVAL     = 1 * time.Minute
+	REAPER_BATCH        = 100 // servers deleted per transaction
+	OPTIMIZE_INTERVAL   = 1 * time.Hour
+	CHECKPOINT_INTERVAL = 10 * time.Minute
+)
+
+func init_reaper(offlinettl time.Duration, deletettl time.Duration) {
+
+	r := reaper{offlinettl: offlinettl, deletettl: deletettl}
+
+	maintenance := []*tasks.Task{
+		{Interval: REAPER_INTERVAL, TaskFunc: r.reap},
+		{Interval: OPTIMIZE_INTERVAL, TaskFunc: DATABASE.Optimize},
+		{Interval: CHECKPOINT_INTERVAL, TaskFunc: checkpoint},
+	}
+
+	for _, task := range maintenance {
+
+		task.RunSingleInstance = true
+		task.ErrFunc = func(err error) {
+			DB.Printf("Maintenance task error: (%s)", err)
+		}
+
+		_, err := SCHEDULER.Add(task)
+
+		if err != nil {
+			DB.Fatalf("Unable to schedule database maintenance (%s)", err)
+		}
+	}
+
+	INFO.Printf("Reaper sets servers offline after %s and deletes them after %s without heartbeat (0 = never)", offlinettl, deletettl)
+}
+
+func (r reaper) reap() error {
+
+	if r.offlinettl > 0 {
+
+		servers, err := REGISTRY.MarkOffline(r.offlinettl)
+
+		if err != nil {
+			return err
+		}
+
+		if len(servers) > 0 {
+			DB.Printf("Reaper set %d servers offline", len(servers))
+		}
+	}
+
+	if r.deletettl > 0 {
+
+		total := 0
+
+		for {
+			serverurls, err := REGISTRY.DeleteStale(r.deletettl, REAPER_BATCH)
+
+			if err != nil {
+				return err
+			}
+
+			total += len(serverurls)
+
+			if len(serverurls) < REAPER_BATCH {
+				break
+			}
+		}
+
+		if total > 0 {
+			DB.Printf("Reaper deleted %d servers", total)
+		}
+	}
+
+	return nil
+}
+
+func checkpoint() error {
+
+	busy, err := DATABASE.Checkpoint()
+
+	if busy {
+		METRICS.dbBusy.Add(1)
+		DB.Printf("WAL checkpoint could not complete, readers were busy")
+	}
+
+	return err
+}
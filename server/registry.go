@@ -0,0 +1,602 @@
+package main
+
+import (
+	"encoding/base64"
+	"encoding/binary"
+	"errors"
+	"sort"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// In-memory copy of every GameServer+Clients row, kept in front of SQLite so
+// the read endpoints never touch the database.
+//
+// Readers load the current snapshot with a single atomic pointer read and never
+// lock. Writers serialise on a mutex, apply the change to the database, and then
+// publish a new snapshot built from a copy of the previous one (copy-on-write).
+// A published snapshot is never modified.
+type registry struct {
+	current atomic.Pointer[registrySnapshot]
+	writer  sync.Mutex
+	batch   *writeBehind // group commit of writes, nil if disabled (see init_writebehind)
+}
+
+type registrySnapshot struct {
+	generation uint64                // bumped on every published change
+	rows       GameServerClientSlice // Game, Status DESC, Curplayers DESC, Server
+	byLiveness GameServerClientSlice // Status DESC, Lastping DESC (used when filtering by appkey)
+
+	platforms          sync.Once        // builds the two indexes below on first use, see byPlatform
+	rowsByPlatform     map[string][]int // lowercase platform => positions in rows
+	livenessByPlatform map[string][]int // lowercase platform => positions in byLiveness
+}
+
+var REGISTRY registry
+
+// load the full registry from the database. Used at startup.
+func init_registry() {
+
+	err := REGISTRY.Reload()
+
+	if err != nil {
+		DB.Fatalf("Unable to load the server registry (%s)", err)
+	}
+
+	DB.Printf("Loaded %d server/client rows into the registry", len(REGISTRY.Snapshot().rows))
+}
+
+// current snapshot. Never nil, never modified once returned.
+func (r *registry) Snapshot() *registrySnapshot {
+
+	snap := r.current.Load()
+
+	if snap == nil {
+		return &registrySnapshot{}
+	}
+
+	return snap
+}
+
+// replace the snapshot with the contents of the database
+func (r *registry) Reload() error {
+
+	r.writer.Lock()
+	defer r.writer.Unlock()
+
+	rows, err := txGameServerGetAll()
+
+	if err != nil {
+		return err
+	}
+
+	sort.Slice(rows, func(i, j int) bool {
+		return lessByGame(&rows[i], &rows[j])
+	})
+
+	byLiveness := make(GameServerClientSlice, len(rows))
+	copy(byLiveness, rows)
+
+	sort.Slice(byLiveness, func(i, j int) bool {
+		return lessByLiveness(&byLiveness[i], &byLiveness[j])
+	})
+
+	r.publish(rows, byLiveness)
+
+	return nil
+}
+
+// upsert the server in the database and patch the snapshot
+func (r *registry) Upsert(gs GameServer) error {
+
+	if r.batch != nil {
+		return r.batch.Submit(gs, false)
+	}
+
+	r.writer.Lock()
+	defer r.writer.Unlock()
+
+	err := txGameServerUpsert(gs)
+
+	if err != nil {
+		return err
+	}
+
+	r.patch([]*writeOp{{server: gs}})
+
+	return nil
+}
+
+// delete the server from the database and the snapshot
+func (r *registry) Delete(serverurl string) error {
+
+	if r.batch != nil {
+		return r.batch.Submit(GameServer{Serverurl: serverurl}, true)
+	}
+
+	r.writer.Lock()
+	defer r.writer.Unlock()
+
+	err := txGameServerDelete(serverurl)
+
+	if err != nil {
+		return err
+	}
+
+	r.patch([]*writeOp{{server: GameServer{Serverurl: serverurl}, deleted: true}})
+
+	return nil
+}
+
+// write a batch of upserts and deletes in one transaction and patch the snapshot once
+func (r *registry) ApplyBatch(ops []*writeOp) error {
+
+	r.writer.Lock()
+	defer r.writer.Unlock()
+
+	err := txGameServerWriteBatch(ops)
+
+	if err != nil {
+		return err
+	}
+
+	r.patch(ops)
+
+	return nil
+}
+
+// Set offline the servers without a heartbeat for ttl. Returns the servers
+// changed, as they are now.
+func (r *registry) MarkOffline(ttl time.Duration) (GameServerSlice, error) {
+
+	r.writer.Lock()
+	defer r.writer.Unlock()
+
+	serverurls, err := txGameServerMarkOffline(ttl)
+
+	if err != nil || len(serverurls) == 0 {
+		return nil, err
+	}
+
+	offline := make(map[string]bool, len(serverurls))
+
+	for _, serverurl := range serverurls {
+		offline[serverurl] = true
+	}
+
+	// rows of the same server are contiguous, as they share every sort key
+	var changed GameServerClientSlice
+
+	for _, gsc := range r.Snapshot().rows {
+		if offline[gsc.Serverurl] {
+			gsc.Status = "offline"
+			changed = append(changed, gsc)
+		}
+	}
+
+	r.replace(offline, changed)
+
+	servers := changed.toGameServerSlice()
+	generation := r.Snapshot().generation
+	events := make([]registryEvent, 0, len(servers))
+
+	for i := range servers {
+		events = append(events, registryEvent{Generation: generation, Type: EVENT_UPSERT, Serverurl: servers[i].Serverurl, Server: &servers[i]})
+		WEBHOOKS.NotifyUpdate(servers[i])
+	}
+
+	EVENTLOG.Append(events...)
+
+	return servers, nil
+}
+
+// Delete up to limit servers without a heartbeat for ttl. Returns their serverurls.
+func (r *registry) DeleteStale(ttl time.Duration, limit int) ([]string, error) {
+
+	r.writer.Lock()
+	defer r.writer.Unlock()
+
+	serverurls, err := txGameServerDeleteStale(ttl, limit)
+
+	if err != nil || len(serverurls) == 0 {
+		return nil, err
+	}
+
+	deleted := make(map[string]bool, len(serverurls))
+
+	for _, serverurl := range serverurls {
+		deleted[serverurl] = true
+	}
+
+	r.replace(deleted, nil)
+
+	generation := r.Snapshot().generation
+	events := make([]registryEvent, 0, len(serverurls))
+
+	for _, serverurl := range serverurls {
+		events = append(events, registryEvent{Generation: generation, Type: EVENT_EXPIRE, Serverurl: serverurl})
+		WEBHOOKS.NotifyDelete(GameServerDelete{Serverurl: serverurl})
+	}
+
+	EVENTLOG.Append(events...)
+
+	return serverurls, nil
+}
+
+// publish a snapshot with the writes applied. Caller holds r.writer.
+func (r *registry) patch(ops []*writeOp) {
+
+	serverurls := make(map[string]bool, len(ops))
+
+	for _, op := range ops {
+		serverurls[op.server.Serverurl] = true
+	}
+
+	var inserted GameServerClientSlice
+
+	lastping := time.Now().UTC().Truncate(time.Second) // same resolution as CURRENT_TIMESTAMP
+
+	for _, op := range ops {
+
+		if op.deleted {
+			continue
+		}
+
+		for _, client := range op.server.Clients {
+			inserted = append(inserted, op.server.toGameServerClient(client, lastping))
+		}
+	}
+
+	r.replace(serverurls, inserted)
+
+	EVENTLOG.Append(registryEvents(r.Snapshot().generation, ops)...)
+
+	// still under r.writer, so webhooks get the writes of a server in the order they were applied
+	for _, op := range ops {
+		if op.deleted {
+			WEBHOOKS.NotifyDelete(GameServerDelete{Serverurl: op.server.Serverurl})
+		} else {
+			WEBHOOKS.NotifyUpdate(op.server)
+		}
+	}
+}
+
+// publish a snapshot where the rows of serverurls are replaced by inserted (in
+// any order). Only inserted is sorted: both orders of the current snapshot are
+// merged with it in a single pass. Caller holds r.writer.
+func (r *registry) replace(serverurls map[string]bool, inserted GameServerClientSlice) {
+
+	snap := r.Snapshot()
+
+	sort.Slice(inserted, func(i, j int) bool {
+		return lessByGame(&inserted[i], &inserted[j])
+	})
+
+	live := make(GameServerClientSlice, len(inserted))
+	copy(live, inserted)
+
+	sort.Slice(live, func(i, j int) bool {
+		return lessByLiveness(&live[i], &live[j])
+	})
+
+	r.publish(snap.rows.merge(serverurls, inserted, lessByGame), snap.byLiveness.merge(serverurls, live, lessByLiveness))
+}
+
+// rows must be sorted by game and byLiveness by liveness. Caller holds r.writer.
+func (r *registry) publish(rows GameServerClientSlice, byLiveness GameServerClientSlice) {
+
+	r.current.Store(&registrySnapshot{
+		generation: r.Snapshot().generation + 1,
+		rows:       rows,
+		byLiveness: byLiveness,
+	})
+}
+
+// Platform indexes of rows and byLiveness. They are built by the first reader
+// that needs them rather than on publish, so a burst of heartbeats doesn't
+// index snapshots that nobody reads.
+func (snap *registrySnapshot) byPlatform() (rowsByPlatform map[string][]int, livenessByPlatform map[string][]int) {
+
+	snap.platforms.Do(func() {
+		snap.rowsByPlatform = indexByPlatform(snap.rows)
+		snap.livenessByPlatform = indexByPlatform(snap.byLiveness)
+	})
+
+	return snap.rowsByPlatform, snap.livenessByPlatform
+}
+
+// Visit, in order, the positions of the rows matching platform (and appkey, -1
+// for any) that sort after the row after (nil for all of them), until visit
+// returns false.
+// Platform is matched as a case-insensitive substring, like the SQL LIKE '%platform%':
+// the query is resolved against the distinct platform names first, and only the
+// rows of the matching platforms are visited.
+func (snap *registrySnapshot) scan(platform string, appkey int, after *GameServerClient, visit func(rows GameServerClientSlice, i int) bool) {
+
+	rowsByPlatform, livenessByPlatform := snap.byPlatform()
+
+	rows, index, less := snap.rows, rowsByPlatform, lessByGame
+
+	if appkey != -1 {
+		rows, index, less = snap.byLiveness, livenessByPlatform, lessByLiveness
+	}
+
+	platform = strings.ToLower(platform)
+
+	var lists [][]int
+
+	for name, positions := range index {
+
+		if !strings.Contains(name, platform) {
+			continue
+		}
+
+		start := 0
+
+		if after != nil {
+			start = sort.Search(len(positions), func(k int) bool {
+				return less(after, &rows[positions[k]])
+			})
+		}
+
+		if start < len(positions) {
+			lists = append(lists, positions[start:])
+		}
+	}
+
+	// merge the position lists of the matching platforms (usually just one)
+	for len(lists) > 0 {
+
+		m := 0
+		for k := range lists {
+			if lists[k][0] < lists[m][0] {
+				m = k
+			}
+		}
+
+		i := lists[m][0]
+
+		if lists[m] = lists[m][1:]; len(lists[m]) == 0 {
+			lists[m] = lists[len(lists)-1]
+			lists = lists[:len(lists)-1]
+		}
+
+		if appkey != -1 && rows[i].Appkey != appkey {
+			continue
+		}
+
+		if !visit(rows, i) {
+			return
+		}
+	}
+}
+
+// Same result as txGameServerGetBy, served from memory.
+func (snap *registrySnapshot) GetBy(platform string, appkey int, pagesize int, offset int) (output GameServerClientSlice) {
+
+	snap.pageBy(platform, appkey, pagesize, offset, func(gsc *GameServerClient) {
+		output = append(output, *gsc)
+	})
+
+	return output
+}
+
+// Visit, in order, the rows GetBy returns, without copying them
+func (snap *registrySnapshot) pageBy(platform string, appkey int, pagesize int, offset int, visit func(gsc *GameServerClient)) {
+
+	// mimic SQLite: a negative LIMIT means no limit, a negative OFFSET means 0
+	if pagesize == 0 {
+		return
+	}
+
+	visited := 0
+
+	snap.scan(platform, appkey, nil, func(rows GameServerClientSlice, i int) bool {
+
+		if offset > 0 {
+			offset--
+			return true
+		}
+
+		visit(&rows[i])
+		visited++
+
+		return pagesize < 0 || visited < pagesize
+	})
+}
+
+// Keyset version of GetBy. after is the cursor returned with the previous page
+// (CURSOR_FIRST for the first one): the sort key of the last row sent. The page
+// starts right after that key with a binary search instead of skipping offset
+// matches, so rows written between two pages don't make the rows that stayed
+// put skip or repeat. next is the cursor for the following page, "" if there are
+// no more rows.
+func (snap *registrySnapshot) GetAfter(platform string, appkey int, pagesize int, after string) (output GameServerClientSlice, next string, err error) {
+
+	key, err := decodeCursor(after)
+
+	if err != nil {
+		return nil, "", err
+	}
+
+	last := snap.pageAfter(platform, appkey, pagesize, key, func(gsc *GameServerClient) {
+		output = append(output, *gsc)
+	})
+
+	if last != nil {
+		next = encodeCursor(last)
+	}
+
+	return output, next, nil
+}
+
+// Visit, in order, the rows GetAfter returns, without copying them. Returns the
+// last row visited if there are more rows after it, nil otherwise.
+func (snap *registrySnapshot) pageAfter(platform string, appkey int, pagesize int, after *GameServerClient, visit func(gsc *GameServerClient)) (last *GameServerClient) {
+
+	var previous *GameServerClient
+
+	visited := 0
+
+	snap.scan(platform, appkey, after, func(rows GameServerClientSlice, i int) bool {
+
+		// one more match than requested: there is a next page after previous
+		if pagesize >= 0 && visited >= pagesize {
+			last = previous
+			return false
+		}
+
+		visit(&rows[i])
+		visited++
+		previous = &rows[i]
+
+		return true
+	})
+
+	return last
+}
+
+// cursor of the first page
+const CURSOR_FIRST = "0"
+
+var ErrInvalidCursor = errors.New("after must be 0 or the cursor returned with the previous page")
+
+// URL safe cursor with the sort key of row in both orders, see lessByGame and
+// lessByLiveness
+func encodeCursor(row *GameServerClient) string {
+
+	buf := make([]byte, 0, 32+len(row.Game)+len(row.Server)+len(row.Serverurl)+len(row.Client_platform)+len(row.Client_url))
+
+	for _, field := range [...]string{row.Game, row.Status, row.Server, row.Serverurl, row.Client_platform, row.Client_url} {
+		buf = binary.AppendUvarint(buf, uint64(len(field)))
+		buf = append(buf, field...)
+	}
+
+	buf = binary.AppendVarint(buf, int64(row.Curplayers))
+	buf = binary.AppendVarint(buf, row.Lastping.UnixNano())
+
+	return base64.RawURLEncoding.EncodeToString(buf)
+}
+
+// sort key of a cursor from encodeCursor, nil for CURSOR_FIRST
+func decodeCursor(cursor string) (*GameServerClient, error) {
+
+	if cursor == CURSOR_FIRST {
+		return nil, nil
+	}
+
+	buf, err := base64.RawURLEncoding.DecodeString(cursor)
+
+	if err != nil {
+		return nil, ErrInvalidCursor
+	}
+
+	row := &GameServerClient{}
+
+	for _, field := range [...]*string{&row.Game, &row.Status, &row.Server, &row.Serverurl, &row.Client_platform, &row.Client_url} {
+
+		n, k := binary.Uvarint(buf)
+
+		if k <= 0 || n > uint64(len(buf)-k) {
+			return nil, ErrInvalidCursor
+		}
+
+		*field = string(buf[k : k+int(n)])
+		buf = buf[k+int(n):]
+	}
+
+	curplayers, k := binary.Varint(buf)
+
+	if k <= 0 {
+		return nil, ErrInvalidCursor
+	}
+
+	lastping, n := binary.Varint(buf[k:])
+
+	if n <= 0 || k+n != len(buf) {
+		return nil, ErrInvalidCursor
+	}
+
+	row.Curplayers = int(curplayers)
+	row.Lastping = time.Unix(0, lastping)
+
+	return row, nil
+}
+
+// lowercase platform => positions of its rows, in ascending order
+func indexByPlatform(rows GameServerClientSlice) map[string][]int {
+
+	index := make(map[string][]int)
+
+	for i := range rows {
+		platform := strings.ToLower(rows[i].Client_platform)
+		index[platform] = append(index[platform], i)
+	}
+
+	return index
+}
+
+// copy of s without the rows of serverurls, with inserted merged in. s and
+// inserted must be sorted according to less.
+func (s GameServerClientSlice) merge(serverurls map[string]bool, inserted GameServerClientSlice, less func(a, b *GameServerClient) bool) GameServerClientSlice {
+
+	output := make(GameServerClientSlice, 0, len(s)+len(inserted))
+
+	for i := range s {
+
+		if serverurls[s[i].Serverurl] {
+			continue
+		}
+
+		for len(inserted) > 0 && less(&inserted[0], &s[i]) {
+			output = append(output, inserted[0])
+			inserted = inserted[1:]
+		}
+
+		output = append(output, s[i])
+	}
+
+	return append(output, inserted...)
+}
+
+// ORDER BY Game, Status DESC, Curplayers DESC, Server. Serverurl, platform and
+// client url break ties, so rows of the same server always stay together and
+// only identical rows compare equal (see GetAfter).
+func lessByGame(a, b *GameServerClient) bool {
+
+	switch {
+	case a.Game != b.Game:
+		return a.Game < b.Game
+	case a.Status != b.Status:
+		return a.Status > b.Status
+	case a.Curplayers != b.Curplayers:
+		return a.Curplayers > b.Curplayers
+	case a.Server != b.Server:
+		return a.Server < b.Server
+	case a.Serverurl != b.Serverurl:
+		return a.Serverurl < b.Serverurl
+	case a.Client_platform != b.Client_platform:
+		return a.Client_platform < b.Client_platform
+	}
+
+	return a.Client_url < b.Client_url
+}
+
+// ORDER BY Status DESC, Lastping DESC
+func lessByLiveness(a, b *GameServerClient) bool {
+
+	switch {
+	case a.Status != b.Status:
+		return a.Status > b.Status
+	case !a.Lastping.Equal(b.Lastping):
+		return a.Lastping.After(b.Lastping)
+	case a.Serverurl != b.Serverurl:
+		return a.Serverurl < b.Serverurl
+	case a.Client_platform != b.Client_platform:
+		return a.Client_platform < b.Client_platform
+	}
+
+	return a.Client_url < b.Client_url
+}
@@ -0,0 +1,25 @@
+//go:build linux || darwin || dragonfly || freebsd || netbsd || openbsd
+
+package main
+
+import (
+	"syscall"
+
+	"golang.org/x/sys/unix"
+)
+
+// net.ListenConfig Control setting SO_REUSEPORT, see listen
+func reusePort(network string, address string, conn syscall.RawConn) error {
+
+	var err error
+
+	controlErr := conn.Control(func(fd uintptr) {
+		err = unix.SetsockoptInt(int(fd), unix.SOL_SOCKET, unix.SO_REUSEPORT, 1)
+	})
+
+	if controlErr != nil {
+		return controlErr
+	}
+
+	return err
+}
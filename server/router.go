@@ -0,0 +1,131 @@
+package main
+
+import (
+	"encoding/json"
+	"net/http"
+	"net/url"
+	"strings"
+
+	"github.com/gin-gonic/gin"
+)
+
+// Routing layers, chosen with -router:
+//
+//   - gin: every route on a gin engine, with its middleware.
+//   - mux: the hot routes on a plain http.ServeMux, without any middleware
+//     besides the metrics and access log, and every other route (/events, /metrics, 404s) left
+//     to the gin engine.
+//
+// Handlers of the hot routes are plain net/http handlers, so both layers send
+// the very same responses.
+const (
+	ROUTER_GIN = "gin"
+	ROUTER_MUX = "mux"
+)
+
+// the hot routes, served by both layers
+var HOT_ROUTES = []struct {
+	method  string
+	path    string
+	handler http.HandlerFunc
+}{
+	{http.MethodGet, "/", ShowServersHtml},
+	{http.MethodGet, "/docs", ShowDocs},
+	{http.MethodGet, "/viewFull", ShowServers},
+	{http.MethodGet, "/view", ShowServersMinimised},
+	{http.MethodGet, "/version", ShowStatus},
+	{http.MethodPost, "/server", UpsertServer},
+	{http.MethodDelete, "/server", DeleteServer},
+}
+
+// handler of the routing layer kind, on top of a gin engine with its middleware
+func newRouter(kind string, engine *gin.Engine) http.Handler {
+
+	engine.Use(MetricsMiddleware)
+
+	for _, route := range HOT_ROUTES {
+		engine.Handle(route.method, route.path, gin.WrapF(route.handler))
+	}
+
+	engine.GET("/metrics", ShowMetrics)
+	engine.GET("/events", ShowEvents)
+
+	if kind != ROUTER_MUX {
+		return engine
+	}
+
+	mux := http.NewServeMux()
+
+	for _, route := range HOT_ROUTES {
+
+		pattern := route.method + " " + route.path
+
+		// the ServeMux pattern "/" matches every path, "/{$}" only "/"
+		if route.path == "/" {
+			pattern += "{$}"
+		}
+
+		mux.HandleFunc(pattern, measured(route.path, route.handler))
+	}
+
+	mux.Handle("/", engine)
+
+	return mux
+}
+
+// send body as gin's Context.Data does
+func writeData(w http.ResponseWriter, status int, contentType string, body []byte) {
+
+	if len(w.Header().Values("Content-Type")) == 0 {
+		w.Header().Set("Content-Type", contentType)
+	}
+
+	w.WriteHeader(status)
+	w.Write(body)
+}
+
+// send obj as gin's Context.JSON does. No body for statuses that don't allow one.
+func writeJSON(w http.ResponseWriter, status int, obj any) {
+
+	w.Header().Set("Content-Type", "application/json; charset=utf-8")
+
+	if status == http.StatusNoContent || status == http.StatusNotModified || (status >= 100 && status < 200) {
+		w.WriteHeader(status)
+		return
+	}
+
+	body, _ := json.Marshal(obj)
+
+	w.WriteHeader(status)
+	w.Write(body)
+}
+
+// First value of key in a raw query, as url.Values.Get(key) on the parsed query,
+// without parsing the whole query: only values with escapes allocate.
+func queryValue(rawQuery string, key string) string {
+
+	for len(rawQuery) > 0 {
+
+		var pair string
+		pair, rawQuery, _ = strings.Cut(rawQuery, "&")
+
+		// url.ParseQuery drops pairs with semicolons and empty pairs
+		if len(pair) == 0 || strings.Contains(pair, ";") {
+			continue
+		}
+
+		name, value, _ := strings.Cut(pair, "=")
+
+		name, err := url.QueryUnescape(name)
+
+		if err != nil || name != key {
+			continue
+		}
+
+		if value, err = url.QueryUnescape(value); err == nil {
+			return value
+		}
+	}
+
+	return ""
+}
@@ -1,14 +1,67 @@
 package main
 
+import (
+	"database/sql"
+	"errors"
+	"fmt"
+	"time"
+)
+
+// Read queries. They are checked against the indexes at startup (see CheckQueryPlans).
+// Platform filters start from Platforms and Clients (CROSS JOIN fixes that order), so
+// only the servers of the matching platforms are read and sorted.
+const (
+	QUERY_GAMESERVER_GETALL       = "SELECT * FROM GameServerClients ORDER BY Game, Status DESC, Curplayers DESC, Server"
+	QUERY_GAMESERVER_GETBY        = "SELECT GameServer.*, Clients.client_platform as client_platform, Clients.client_url as client_url FROM Platforms CROSS JOIN Clients ON Clients.client_platform = Platforms.platform CROSS JOIN GameServer ON GameServer.Serverurl = Clients.Serverurl WHERE Platforms.platform LIKE $1 ORDER BY Game, Status DESC, Curplayers DESC, Server LIMIT $2 OFFSET $3"
+	QUERY_GAMESERVER_GETBY_APPKEY = "SELECT GameServer.*, Clients.client_platform as client_platform, Clients.client_url as client_url FROM Platforms CROSS JOIN Clients ON Clients.client_platform = Platforms.platform CROSS JOIN GameServer ON GameServer.Serverurl = Clients.Serverurl WHERE Platforms.platform LIKE $1 AND GameServer.Appkey = $2 ORDER BY Status DESC, Lastping DESC LIMIT $3 OFFSET $4"
+)
+
+// Write queries
+const (
+	// update in place, so heartbeats don't delete and re-insert the server and all its clients
+	QUERY_GAMESERVER_UPSERT = `--sql
+		INSERT INTO GameServer (Serverurl, Game, Appkey, Server, Region, Status, Maxplayers, Curplayers, Lastping)
+		VALUES ($1, $2, $3, $4, $5, $6, $7, $8, CURRENT_TIMESTAMP)
+		ON CONFLICT(Serverurl) DO UPDATE SET
+			Game = excluded.Game, Appkey = excluded.Appkey, Server = excluded.Server, Region = excluded.Region,
+			Status = excluded.Status, Maxplayers = excluded.Maxplayers, Curplayers = excluded.Curplayers,
+			Lastping = CURRENT_TIMESTAMP -- refreshed on every heartbeat
+	`
+	QUERY_GAMESERVER_DELETE = `--sql
+		DELETE FROM GameServer WHERE Serverurl = $1 -- will delete Clients with DELETE ON CASCADE
+	`
+	QUERY_CLIENTS_GETBY_SERVER = `--sql
+		SELECT rowid, client_platform, client_url FROM Clients WHERE serverurl = $1
+	`
+	QUERY_CLIENT_INSERT = `--sql
+		INSERT INTO Clients (serverurl, client_platform, client_url) VALUES ($1, $2, $3) -- insert each of the new clients for the previous server
+	`
+	QUERY_CLIENT_DELETE = `--sql
+		DELETE FROM Clients WHERE rowid = $1 -- clients the server doesn't submit anymore
+	`
+	QUERY_PLATFORM_INSERT = `--sql
+		INSERT OR IGNORE INTO Platforms (platform) VALUES ($1) -- register platforms not seen before
+	`
+	// $1 is a datetime() modifier like '-900 seconds'. Lastping keeps the time of the last heartbeat.
+	QUERY_GAMESERVER_MARK_OFFLINE = `--sql
+		UPDATE GameServer SET Status = 'offline' WHERE Status = 'online' AND Lastping < datetime('now', $1) RETURNING Serverurl
+	`
+	QUERY_GAMESERVER_DELETE_STALE = `--sql
+		DELETE FROM GameServer WHERE Serverurl IN (SELECT Serverurl FROM GameServer WHERE Lastping < datetime('now', $1) LIMIT $2) RETURNING Serverurl
+	`
+)
+
 // Retrieve all GameServers with its clients from the database ordered according to 'liveness'
 func txGameServerGetAll() (output GameServerClientSlice, err error) {
 
+	defer observeQuery("txGameServerGetAll", time.Now(), &err)
+
 	// output should be: online first, offline last. Inside each category, newer last ping goes first
 
-	err = DATABASE.Select(&output, "SELECT * FROM GameServerClients ORDER BY Game, Status DESC, Curplayers DESC, Server ")
+	err = DATABASE.stmt.gameServerGetAll.Select(&output)
 
 	if err != nil {
-		DB.Printf("%s error: %s", extendedFnName(), err)
+		DB.CallerPrintf("error: %s", err)
 		return output, err
 	}
 
@@ -16,22 +69,24 @@ func txGameServerGetAll() (output GameServerClientSlice, err error) {
 }
 
 // Retrieve GameServers with its clients filtered by platform and appkey (optional) from the database ordered according to 'liveness'
-// TODO: we added a simple (and cpu consuming) pagination. It would be better to use a index based, as per:
-// https://www2.sqlite.org/cvstrac/wiki?p=ScrollingCursor
-// but that would require to change the protocol with the client: they will have to send the latest client received
+// Pagination here is LIMIT/OFFSET. /view is served from the in-memory registry instead, which also
+// supports cursor pagination (registrySnapshot.GetAfter, as per https://www2.sqlite.org/cvstrac/wiki?p=ScrollingCursor)
 func txGameServerGetBy(platform string, appkey int, pagesize int, offset int) (output GameServerClientSlice, err error) {
 
+	defer observeQuery("txGameServerGetBy", time.Now(), &err)
+
 	// LIKE is used to match the platform by partial match. e.g. "spectrum" will match "spectrum48", "spectrum128".
 	// Note that SQLite LIKE operator is case-insensitive. It means "A" LIKE "a" is true.
+	// The LIKE only scans Platforms (one row per distinct platform); Clients is then searched by client_platform.
 	if appkey == -1 {
 		// Sort by Game (so client can efficiently group by game name), Status (so OFFLINE stay at the bottom), Curplayers (so populated servers are at the top), and finally Server name
-		err = DATABASE.Select(&output, "SELECT * FROM GameServerClients WHERE client_platform LIKE $1 ORDER BY Game, Status DESC, Curplayers DESC, Server LIMIT $2 OFFSET $3", "%"+platform+"%", pagesize, offset)
+		err = DATABASE.stmt.gameServerGetBy.Select(&output, "%"+platform+"%", pagesize, offset)
 	} else {
-		err = DATABASE.Select(&output, "SELECT * FROM GameServerClients WHERE client_platform LIKE $1 AND appkey=$2 ORDER BY Status DESC, Lastping DESC LIMIT $3 OFFSET $4", "%"+platform+"%", appkey, pagesize, offset)
+		err = DATABASE.stmt.gameServerGetByAppkey.Select(&output, "%"+platform+"%", appkey, pagesize, offset)
 	}
 
 	if err != nil {
-		DB.Printf("%s error: (%s)", extendedFnName(), err)
+		DB.CallerPrintf("error: (%s)", err)
 		return output, err
 	}
 
@@ -41,61 +96,159 @@ func txGameServerGetBy(platform string, appkey int, pagesize int, offset int) (o
 // Upsert new GameServer with client input
 func txGameServerUpsert(gs GameServer) (err error) {
 
+	defer observeQuery("txGameServerUpsert", time.Now(), &err)
+
 	tx, err := DATABASE.Begin()
 
 	if err != nil {
-		DB.Printf("%s error beginTx: (%s)", extendedFnName(), err)
-		tx.Rollback()
+		DB.CallerPrintf("error beginTx: (%s)", err)
 
 		return err
 	}
 
-	queryDelete := `--sql
-		DELETE FROM GameServer WHERE Serverurl = $1 -- will delete Clients with DELETE ON CASCADE
-	`
+	err = txGameServerUpsertIn(tx, gs)
 
-	_, err = tx.Exec(queryDelete, gs.Serverurl)
+	if err != nil {
+		tx.Rollback()
+
+		return err
+	}
+
+	err = tx.Commit()
 
 	if err != nil {
-		DB.Printf("%s error delete: (%s)", extendedFnName(), err)
+		DB.CallerPrintf("error: (%s)", err)
 		tx.Rollback()
 
 		return err
 	}
 
-	queryInsert := `--sql
-		INSERT INTO GameServer (Serverurl, Game, Appkey, Server, Region, Status, Maxplayers, Curplayers)
-		VALUES ($1, $2, $3, $4, $5, $6, $7, $8) -- insert main server
-	`
+	return nil
+}
+
+// Upsert GameServer with its clients as part of transaction tx. Caller commits or rolls back.
+func txGameServerUpsertIn(tx *sql.Tx, gs GameServer) (err error) {
+
+	defer observeQuery("txGameServerUpsertIn", time.Now(), &err)
 
-	_, err = tx.Exec(queryInsert, gs.Serverurl, gs.Game, gs.Appkey, gs.Server, gs.Region, gs.Status, gs.Maxplayers, gs.Curplayers)
+	_, err = tx.Stmt(DATABASE.stmt.gameServerUpsert.Stmt).Exec(gs.Serverurl, gs.Game, gs.Appkey, gs.Server, gs.Region, gs.Status, gs.Maxplayers, gs.Curplayers)
 
 	if err != nil {
-		DB.Printf("%s error insert GameServer: (%s)", extendedFnName(), err)
-		tx.Rollback()
+		DB.CallerPrintf("error upsert GameServer: (%s)", err)
+		return err
+	}
 
+	// diff the stored clients against the submitted ones: only new clients are inserted
+	// and only clients no longer submitted are deleted
+	rows, err := tx.Stmt(DATABASE.stmt.clientsGetByServer.Stmt).Query(gs.Serverurl)
+
+	if err != nil {
+		DB.CallerPrintf("error select Clients: (%s)", err)
 		return err
 	}
 
-	queryClient := `--sql
-		INSERT INTO Clients (serverurl, client_platform, client_url) VALUES ($1, $2, $3) -- insert each of the clients for the previous server
-	`
+	stored := make(map[GameClient][]int64)
+
+	for rows.Next() {
+
+		var rowid int64
+		var client GameClient
+
+		err = rows.Scan(&rowid, &client.Platform, &client.Url)
+
+		if err != nil {
+			break
+		}
+
+		stored[client] = append(stored[client], rowid)
+	}
+
+	rows.Close()
+
+	if err = errors.Join(err, rows.Err()); err != nil {
+		DB.CallerPrintf("error select Clients: (%s)", err)
+		return err
+	}
+
+	clientInsert := tx.Stmt(DATABASE.stmt.clientInsert.Stmt)
+	platformInsert := tx.Stmt(DATABASE.stmt.platformInsert.Stmt)
+
 	for _, client := range gs.Clients {
-		_, err = tx.Exec(queryClient, gs.Serverurl, client.Platform, client.Url)
+
+		// already stored, nothing to write
+		if rowids := stored[client]; len(rowids) > 0 {
+			stored[client] = rowids[1:]
+			continue
+		}
+
+		_, err = clientInsert.Exec(gs.Serverurl, client.Platform, client.Url)
 
 		if err != nil {
-			DB.Printf("%s error insert Client: (%s)", extendedFnName(), err)
-			tx.Rollback()
+			DB.CallerPrintf("error insert Client: (%s)", err)
+			return err
+		}
 
+		_, err = platformInsert.Exec(client.Platform)
+
+		if err != nil {
+			DB.CallerPrintf("error insert Platform: (%s)", err)
 			return err
 		}
 
 	}
 
+	clientDelete := tx.Stmt(DATABASE.stmt.clientDelete.Stmt)
+
+	for _, rowids := range stored {
+		for _, rowid := range rowids {
+
+			_, err = clientDelete.Exec(rowid)
+
+			if err != nil {
+				DB.CallerPrintf("error delete Client: (%s)", err)
+				return err
+			}
+		}
+	}
+
+	return nil
+}
+
+// Apply a batch of upserts and deletes in a single transaction (one commit for all of them)
+func txGameServerWriteBatch(ops []*writeOp) (err error) {
+
+	defer observeQuery("txGameServerWriteBatch", time.Now(), &err)
+
+	tx, err := DATABASE.Begin()
+
+	if err != nil {
+		DB.CallerPrintf("error beginTx: (%s)", err)
+
+		return err
+	}
+
+	gameServerDelete := tx.Stmt(DATABASE.stmt.gameServerDelete.Stmt)
+
+	for _, op := range ops {
+
+		if op.deleted {
+			_, err = gameServerDelete.Exec(op.server.Serverurl)
+		} else {
+			err = txGameServerUpsertIn(tx, op.server)
+		}
+
+		if err != nil {
+			DB.CallerPrintf("error %s: (%s)", op.server.Serverurl, err)
+			tx.Rollback()
+
+			return err
+		}
+	}
+
 	err = tx.Commit()
 
 	if err != nil {
-		DB.Printf("%s error: (%s)", extendedFnName(), err)
+		DB.CallerPrintf("error: (%s)", err)
 		tx.Rollback()
 
 		return err
@@ -107,16 +260,76 @@ func txGameServerUpsert(gs GameServer) (err error) {
 // Delete a GameServers with its associated clients
 func txGameServerDelete(serverurl string) (err error) {
 
-	query := `--sql
-		DELETE FROM GameServer WHERE Serverurl = $1 
-	`
+	defer observeQuery("txGameServerDelete", time.Now(), &err)
 
-	_, err = DATABASE.Exec(query, serverurl)
+	_, err = DATABASE.stmt.gameServerDelete.Exec(serverurl)
 
 	if err != nil {
-		DB.Printf("%s error: (%s)", extendedFnName(), err)
+		DB.CallerPrintf("error: (%s)", err)
 		return err
 	}
 
 	return nil
 }
+
+// Set offline the servers online without a heartbeat for ttl. Returns their serverurls.
+func txGameServerMarkOffline(ttl time.Duration) (serverurls []string, err error) {
+
+	defer observeQuery("txGameServerMarkOffline", time.Now(), &err)
+
+	err = DATABASE.stmt.gameServerMarkOffline.Select(&serverurls, sqliteAgo(ttl))
+
+	if err != nil {
+		DB.CallerPrintf("error: (%s)", err)
+		return nil, err
+	}
+
+	return serverurls, nil
+}
+
+// Delete up to limit servers without a heartbeat for ttl, with their clients. Returns their serverurls.
+func txGameServerDeleteStale(ttl time.Duration, limit int) (serverurls []string, err error) {
+
+	defer observeQuery("txGameServerDeleteStale", time.Now(), &err)
+
+	err = DATABASE.stmt.gameServerDeleteStale.Select(&serverurls, sqliteAgo(ttl), limit)
+
+	if err != nil {
+		DB.CallerPrintf("error: (%s)", err)
+		return nil, err
+	}
+
+	return serverurls, nil
+}
+
+// datetime() modifier for ttl ago, Lastping is stored with second precision
+func sqliteAgo(ttl time.Duration) string {
+	return fmt.Sprintf("-%d seconds", int64(ttl.Seconds()))
+}
+
+// Register in Platforms every client platform that isn't there yet (databases created before the table existed)
+func txPlatformBackfill() (err error) {
+
+	defer observeQuery("txPlatformBackfill", time.Now(), &err)
+
+	var platforms []string
+
+	err = DATABASE.Select(&platforms, "SELECT DISTINCT client_platform FROM Clients WHERE client_platform NOT IN (SELECT platform FROM Platforms)")
+
+	if err != nil {
+		DB.CallerPrintf("error: (%s)", err)
+		return err
+	}
+
+	for _, platform := range platforms {
+
+		_, err = DATABASE.Exec(QUERY_PLATFORM_INSERT, platform)
+
+		if err != nil {
+			DB.CallerPrintf("error: (%s)", err)
+			return err
+		}
+	}
+
+	return nil
+}
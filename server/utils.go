@@ -34,23 +34,6 @@ func currentFnName() string {
 	return strings.Split(runtime.FuncForPC(current).Name(), ".")[1]
 }
 
-func extendedFnName() string {
-
-	current_name := "unknown"
-	parent_name := "unknown"
-
-	current, _, _, ok := runtime.Caller(1)
-	if ok {
-		current_name = strings.Split(runtime.FuncForPC(current).Name(), ".")[1]
-	}
-	parent, _, _, ok := runtime.Caller(2)
-	if ok {
-		parent_name = strings.Split(runtime.FuncForPC(parent).Name(), ".")[1]
-	}
-
-	return parent_name + "/" + current_name
-}
-
 // copy a file from src to dest with permission 0644
 func CopyFile(src string, dest string) error {
 
@@ -111,11 +94,76 @@ func ErrorIf(condition bool, err error) error {
 
 // TODO: Change err != nil to err == nil and review full codebase
 func IsValidURI(uri string) bool {
+
+	if isPlainRequestURI(uri) {
+		return false
+	}
+
 	_, err := url.ParseRequestURI(uri)
 
 	return err != nil
 }
 
+// Fast, allocation free check for the urls game servers send: a scheme, "://",
+// a host name with an optional port, and an optional path and query made of
+// printable ASCII without percent escapes. url.ParseRequestURI accepts every
+// uri this accepts; anything else is left to it.
+func isPlainRequestURI(uri string) bool {
+
+	i := 0
+
+	// scheme = ALPHA *( ALPHA / DIGIT / "+" / "-" / "." )
+	for ; i < len(uri); i++ {
+
+		b := uri[i]
+		letter := (b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z')
+
+		if letter || (i > 0 && ((b >= '0' && b <= '9') || b == '+' || b == '-' || b == '.')) {
+			continue
+		}
+
+		break
+	}
+
+	if i == 0 || len(uri)-i < 3 || uri[i:i+3] != "://" {
+		return false
+	}
+
+	// host name, then the port
+	for i += 3; i < len(uri); i++ {
+
+		b := uri[i]
+
+		if (b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z') || (b >= '0' && b <= '9') || b == '-' || b == '.' || b == '_' {
+			continue
+		}
+
+		break
+	}
+
+	if i < len(uri) && uri[i] == ':' {
+		for i++; i < len(uri) && uri[i] >= '0' && uri[i] <= '9'; i++ {
+		}
+	}
+
+	if i == len(uri) {
+		return true
+	}
+
+	if uri[i] != '/' && uri[i] != '?' {
+		return false
+	}
+
+	// path and query
+	for ; i < len(uri); i++ {
+		if uri[i] <= ' ' || uri[i] >= 0x7F || uri[i] == '%' {
+			return false
+		}
+	}
+
+	return true
+}
+
 // Returns a byte slice equal to the maxLen+1, padded with zeros
 // The extra byte is added to terminate the string
 func appendFixedLengthString(buf []byte, s string, maxLen int) []byte {
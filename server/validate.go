@@ -0,0 +1,94 @@
+package main
+
+import (
+	"errors"
+	"fmt"
+)
+
+// Input checks of POST and DELETE /server, declared once as tables of rules.
+//
+// A rule is a condition and the message to report when it's broken. Messages
+// are only formatted for the rules that fail, so a valid heartbeat goes through
+// validation without allocating.
+type rule[T any] struct {
+	fails   func(s *T) bool
+	message func(s *T) string
+}
+
+var GAMESERVER_RULES = []rule[GameServer]{
+	{
+		func(s *GameServer) bool { return s.Curplayers < 0 },
+		func(s *GameServer) string {
+			return fmt.Sprintf("key: 'GameServer.Curplayers' Error:Field validation for 'Curplayers' cannot be negative (%d)", s.Curplayers)
+		},
+	},
+	{
+		func(s *GameServer) bool { return s.Maxplayers < 0 },
+		func(s *GameServer) string {
+			return fmt.Sprintf("key: 'GameServer.Maxplayers' Error:Field validation for 'Maxplayers' cannot be negative (%d)", s.Maxplayers)
+		},
+	},
+	{
+		func(s *GameServer) bool { return s.Curplayers > s.Maxplayers },
+		func(s *GameServer) string {
+			return fmt.Sprintf("key: 'GameServer.Curplayers' and 'GameServer.Maxplayers' Error:Field validation for 'Curplayers' (%d) cannot be bigger than 'Maxplayers' (%d)", s.Curplayers, s.Maxplayers)
+		},
+	},
+	{
+		func(s *GameServer) bool { return s.Appkey < 1 || s.Appkey > 255 },
+		message[GameServer]("key: 'GameServer.Appkey' Error: Field validation length must be between 1 and 255"),
+	},
+	{
+		func(s *GameServer) bool { return len(s.Game) < 2 || len(s.Game) > 16 },
+		message[GameServer]("key: 'GameServer.Game' Error: Field validation length must be between 2 and 16 characters"),
+	},
+	{
+		func(s *GameServer) bool { return len(s.Region) > 2 },
+		message[GameServer]("key: 'GameServer.Region' Error: Field validation length must be 2 or less characters"),
+	},
+	{
+		func(s *GameServer) bool { return len(s.Server) > 32 },
+		message[GameServer]("key: 'GameServer.Server' Error: Field validation length must be 32 or less characters"),
+	},
+	{
+		func(s *GameServer) bool { return IsValidURI(s.Serverurl) },
+		message[GameServer](MSG_INVALID_URL),
+	},
+	{
+		func(s *GameServer) bool { return len(s.Serverurl) > 64 },
+		message[GameServer](MSG_URL_TOO_LONG),
+	},
+}
+
+// checked for every client of a GameServer
+var GAMECLIENT_RULES = []rule[GameClient]{
+	{func(s *GameClient) bool { return IsValidURI(s.Url) }, message[GameClient](MSG_INVALID_URL)},
+	{func(s *GameClient) bool { return len(s.Url) > 64 }, message[GameClient](MSG_URL_TOO_LONG)},
+}
+
+var GAMESERVERDELETE_RULES = []rule[GameServerDelete]{
+	{func(s *GameServerDelete) bool { return IsValidURI(s.Serverurl) }, message[GameServerDelete](MSG_INVALID_URL)},
+	{func(s *GameServerDelete) bool { return len(s.Serverurl) > 64 }, message[GameServerDelete](MSG_URL_TOO_LONG)},
+}
+
+const (
+	MSG_INVALID_URL  = "key: 'GameServer.ServerUrl' Error: Field validation has to be a valid url"
+	MSG_URL_TOO_LONG = "key: 'GameServer.ServerUrl' Error: Field validation length must be 64 or less characters"
+)
+
+// message of a rule that doesn't depend on the value
+func message[T any](text string) func(s *T) string {
+	return func(s *T) string { return text }
+}
+
+// join to err the message of every rule s fails, in order
+func checkRules[T any](s *T, rules []rule[T], err error) error {
+
+	for i := range rules {
+		if rules[i].fails(s) {
+			err = errors.Join(err, errors.New(rules[i].message(s)))
+		}
+	}
+
+	return err
+}
@@ -0,0 +1,379 @@
+package main
+
+import (
+	"bytes"
+	"encoding/json"
+	"fmt"
+	"hash/fnv"
+	"io"
+	"net/http"
+	"net/url"
+	"sort"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Delivery of server updates to the event server webhooks, off the request path.
+//
+// Every webhook has its own queue, worker and keep-alive connection pool, so a
+// slow event server only delays its own updates. Queues are keyed by serverurl:
+// an update for a server that is still waiting replaces the previous one, so a
+// queue never holds more than one update per server and is capped at
+// WEBHOOK_MAX_PENDING servers. Failed deliveries are retried with exponential
+// backoff; updates that cannot be delivered are counted as dead letters.
+//
+// Only changes are sent: the dispatcher keeps a digest of the last state it
+// queued for every server and drops heartbeats that don't change it. The digest
+// is forgotten when an update becomes a dead letter, so the next heartbeat sends
+// the state again. Updates are queued by the registry while it publishes the
+// change, so they reach the queues in the order the writes were applied. An
+// optional resync periodically publishes every server in the registry again.
+type webhookDispatcher struct {
+	targets []*webhookTarget
+
+	mu        sync.Mutex
+	digests   map[string]uint64 // serverurl => digest of the last state published
+	unchanged atomic.Uint64     // updates not sent because the state didn't change
+	resyncs   atomic.Uint64
+}
+
+type webhookTarget struct {
+	uri    string
+	index  int    // position among the webhooks in use, logged at startup
+	host   string // of uri, the only part of it on /metrics: paths and queries may carry tokens
+	client *http.Client
+
+	mu      sync.Mutex
+	pending map[string]*webhookEvent // serverurl => latest update not yet sent
+	order   []string                 // serverurls in arrival order
+	wake    chan struct{}
+
+	delivered   atomic.Uint64
+	retried     atomic.Uint64
+	deadletters atomic.Uint64 // dropped because the queue was full or every retry failed
+}
+
+type webhookEvent struct {
+	method    string // POST (update) or DELETE
+	serverurl string
+	body      []byte // marshalled once, shared by every webhook
+}
+
+const (
+	WEBHOOK_MAX_PENDING = 4096
+	WEBHOOK_RETRIES     = 5
+	WEBHOOK_BACKOFF     = 250 * time.Millisecond // doubled after every failed attempt
+)
+
+var WEBHOOKS webhookDispatcher
+
+// start one worker per webhook, and the resync loop if resync > 0
+func init_webhook_dispatcher(uris []string, timeout time.Duration, resync time.Duration) {
+
+	for i, uri := range uris {
+
+		target := &webhookTarget{
+			uri:   uri,
+			index: i,
+			client: &http.Client{
+				Timeout: timeout,
+				Transport: &http.Transport{
+					Proxy:               http.ProxyFromEnvironment,
+					MaxIdleConns:        4,
+					MaxIdleConnsPerHost: 4,
+					IdleConnTimeout:     90 * time.Second,
+				},
+			},
+			pending: make(map[string]*webhookEvent),
+			wake:    make(chan struct{}, 1),
+		}
+
+		if parsed, err := url.Parse(uri); err == nil {
+			target.host = parsed.Host
+		}
+
+		WEBHOOKS.targets = append(WEBHOOKS.targets, target)
+
+		go target.run()
+	}
+
+	if len(WEBHOOKS.targets) > 0 && resync > 0 {
+		go WEBHOOKS.resync(resync)
+		INFO.Printf("Publishing every server to the eventserver webhooks every %s", resync)
+	}
+}
+
+// queue the update of a server for every webhook, unless its state is the one
+// already published. Never blocks.
+func (d *webhookDispatcher) NotifyUpdate(server GameServer) {
+
+	if len(d.targets) == 0 {
+		return
+	}
+
+	if !d.changed(server.Serverurl, server.digest()) {
+		d.unchanged.Add(1)
+		return
+	}
+
+	d.Notify("POST", server.Serverurl, server)
+}
+
+// queue the deletion of a server for every webhook. Never blocks.
+func (d *webhookDispatcher) NotifyDelete(server GameServerDelete) {
+
+	if len(d.targets) == 0 {
+		return
+	}
+
+	d.forget(server.Serverurl)
+
+	d.Notify("DELETE", server.Serverurl, server)
+}
+
+// record digest as the published state of serverurl. false if it already was.
+func (d *webhookDispatcher) changed(serverurl string, digest uint64) bool {
+
+	d.mu.Lock()
+	defer d.mu.Unlock()
+
+	if d.digests == nil {
+		d.digests = make(map[string]uint64)
+	}
+
+	if previous, ok := d.digests[serverurl]; ok && previous == digest {
+		return false
+	}
+
+	d.digests[serverurl] = digest
+
+	return true
+}
+
+// forget the published state of serverurl, so its next update is sent even if
+// it doesn't change anything
+func (d *webhookDispatcher) forget(serverurl string) {
+
+	d.mu.Lock()
+	delete(d.digests, serverurl)
+	d.mu.Unlock()
+}
+
+// Publish every server in the registry, changed or not, every interval. Catches
+// up event servers that missed updates (dead letters, restarts on their side).
+func (d *webhookDispatcher) resync(interval time.Duration) {
+
+	ticker := time.NewTicker(interval)
+	defer ticker.Stop()
+
+	for range ticker.C {
+
+		for _, server := range REGISTRY.Snapshot().rows.toGameServerSlice() {
+			d.changed(server.Serverurl, server.digest())
+			d.Notify("POST", server.Serverurl, server)
+		}
+
+		d.resyncs.Add(1)
+	}
+}
+
+// queue the update of a server (POST) or its deletion (DELETE) for every webhook. Never blocks.
+func (d *webhookDispatcher) Notify(method string, serverurl string, ServerData any) {
+
+	if len(d.targets) == 0 {
+		return
+	}
+
+	body, err := json.Marshal(ServerData)
+	if err != nil {
+		ERROR.Printf("Unable to json.Marshal %v", ServerData)
+		return
+	}
+
+	event := &webhookEvent{method: method, serverurl: serverurl, body: body}
+
+	for _, target := range d.targets {
+		target.enqueue(event)
+	}
+}
+
+// updates waiting to be sent, across all webhooks
+func (d *webhookDispatcher) Pending() (pending int) {
+
+	for _, target := range d.targets {
+		target.mu.Lock()
+		pending += len(target.order)
+		target.mu.Unlock()
+	}
+
+	return pending
+}
+
+func (t *webhookTarget) enqueue(event *webhookEvent) {
+
+	t.mu.Lock()
+
+	if _, waiting := t.pending[event.serverurl]; !waiting {
+
+		if len(t.order) >= WEBHOOK_MAX_PENDING {
+			t.mu.Unlock()
+			t.deadletters.Add(1)
+			WEBHOOKS.forget(event.serverurl)
+			WARN.Printf("Webhook %s queue is full, update for %s dropped", t, event.serverurl)
+
+			return
+		}
+
+		t.order = append(t.order, event.serverurl)
+	}
+
+	t.pending[event.serverurl] = event
+
+	t.mu.Unlock()
+
+	select {
+	case t.wake <- struct{}{}:
+	default:
+	}
+}
+
+// next update to send, nil if the queue is empty
+func (t *webhookTarget) dequeue() *webhookEvent {
+
+	t.mu.Lock()
+	defer t.mu.Unlock()
+
+	if len(t.order) == 0 {
+		return nil
+	}
+
+	serverurl := t.order[0]
+	t.order = t.order[1:]
+
+	event := t.pending[serverurl]
+	delete(t.pending, serverurl)
+
+	return event
+}
+
+// true if a newer update for the server is already queued
+func (t *webhookTarget) superseded(serverurl string) bool {
+
+	t.mu.Lock()
+	defer t.mu.Unlock()
+
+	_, waiting := t.pending[serverurl]
+
+	return waiting
+}
+
+func (t *webhookTarget) run() {
+
+	for range t.wake {
+		for event := t.dequeue(); event != nil; event = t.dequeue() {
+			t.deliver(event)
+		}
+	}
+}
+
+func (t *webhookTarget) deliver(event *webhookEvent) {
+
+	backoff := WEBHOOK_BACKOFF
+
+	for attempt := 1; ; attempt++ {
+
+		retry, err := t.send(event)
+
+		if err == nil {
+			t.delivered.Add(1)
+			return
+		}
+
+		if !retry || attempt >= WEBHOOK_RETRIES {
+			t.deadletters.Add(1)
+			WEBHOOKS.forget(event.serverurl)
+			ERROR.Printf("Unable to post event to webhook: %s (%s), giving up after %d attempts", t, err, attempt)
+
+			return
+		}
+
+		DEBUG.Printf("Webhook %s attempt %d failed (%s), retrying in %s", t, attempt, err, backoff)
+
+		time.Sleep(backoff)
+		backoff *= 2
+
+		// no point retrying an update that a newer one replaces
+		if t.superseded(event.serverurl) {
+			return
+		}
+
+		t.retried.Add(1)
+	}
+}
+
+// in logs, like on /metrics: index and host, never the full url
+func (t *webhookTarget) String() string {
+	return fmt.Sprintf("%d (%s)", t.index, t.host)
+}
+
+// one delivery attempt. retry is false for errors that would fail again (e.g. 4xx).
+func (t *webhookTarget) send(event *webhookEvent) (retry bool, err error) {
+
+	req, err := http.NewRequest(event.method, t.uri, bytes.NewReader(event.body))
+
+	if err != nil {
+		return false, err
+	}
+
+	req.Header.Set("X-Lobby-Client", VERSION)
+	req.Header.Set("Content-Type", "application/json")
+
+	resp, err := t.client.Do(req)
+
+	// without the url, which the error of Do starts with
+	if urlErr, ok := err.(*url.Error); ok {
+		err = urlErr.Err
+	}
+
+	if err != nil {
+		return true, err
+	}
+
+	// drain the body so the connection goes back to the pool
+	io.Copy(io.Discard, resp.Body)
+	resp.Body.Close()
+
+	switch {
+	case resp.StatusCode < 300:
+		return false, nil
+	case resp.StatusCode == http.StatusTooManyRequests || resp.StatusCode >= 500:
+		return true, fmt.Errorf("http status %d", resp.StatusCode)
+	}
+
+	return false, fmt.Errorf("http status %d", resp.StatusCode)
+}
+
+// Hash of everything a webhook publishes about the server. Clients are hashed
+// in platform order, so a server listing them in a different order is unchanged.
+func (s GameServer) digest() uint64 {
+
+	clients := make([]GameClient, len(s.Clients))
+	copy(clients, s.Clients)
+
+	sort.Slice(clients, func(i, j int) bool {
+		if clients[i].Platform != clients[j].Platform {
+			return clients[i].Platform < clients[j].Platform
+		}
+		return clients[i].Url < clients[j].Url
+	})
+
+	h := fnv.New64a()
+	fmt.Fprintf(h, "%s\x00%d\x00%s\x00%s\x00%s\x00%d\x00%d", s.Game, s.Appkey, s.Server, s.Region, s.Status, s.Maxplayers, s.Curplayers)
+
+	for _, client := range clients {
+		fmt.Fprintf(h, "\x00%s\x00%s", client.Platform, client.Url)
+	}
+
+	return h.Sum64()
+}
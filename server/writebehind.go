@@ -0,0 +1,138 @@
+package main
+
+import (
+	"sync"
+	"time"
+)
+
+// Optional group commit in front of the registry writes.
+//
+// Instead of one SQLite transaction per POST/DELETE /server (and, with
+// -synchronous FULL, one WAL fsync), writes are queued and flushed together in a
+// single transaction every window, or as soon as size servers are waiting.
+// Repeated writes for the same serverurl are collapsed into the last one. Each
+// request still waits until its batch has been committed, so a 201 keeps meaning
+// the update is committed. Whether a commit survives a power loss is up to
+// -synchronous, as without batching: NORMAL may lose the last ones, FULL doesn't.
+type writeBehind struct {
+	mu      sync.Mutex
+	pending map[string]*writeOp // serverurl => latest write
+	order   []*writeOp          // arrival order
+
+	window time.Duration
+	size   int
+	full   chan struct{}
+}
+
+// an upsert (or a delete) waiting to be committed
+type writeOp struct {
+	server  GameServer // only Serverurl is used for deletes
+	deleted bool
+	waiters []chan error
+}
+
+// enable write coalescing. window 0 keeps one transaction per request.
+func init_writebehind(window time.Duration, size int) {
+
+	if window <= 0 {
+		return
+	}
+
+	wb := &writeBehind{
+		pending: make(map[string]*writeOp),
+		window:  window,
+		size:    max(size, 1),
+		full:    make(chan struct{}, 1),
+	}
+
+	REGISTRY.batch = wb
+
+	go wb.run()
+
+	INFO.Printf("Grouping server writes every %s or %d servers", window, wb.size)
+}
+
+// queue the write and wait for the transaction that commits it
+func (wb *writeBehind) Submit(server GameServer, deleted bool) error {
+
+	done := make(chan error, 1)
+
+	wb.mu.Lock()
+
+	op, ok := wb.pending[server.Serverurl]
+
+	if !ok {
+		op = &writeOp{}
+		wb.pending[server.Serverurl] = op
+		wb.order = append(wb.order, op)
+	}
+
+	// last write wins, everyone waiting on it gets the same result
+	op.server = server
+	op.deleted = deleted
+	op.waiters = append(op.waiters, done)
+
+	if len(wb.order) >= wb.size {
+		select {
+		case wb.full <- struct{}{}:
+		default:
+		}
+	}
+
+	wb.mu.Unlock()
+
+	return <-done
+}
+
+func (wb *writeBehind) run() {
+
+	ticker := time.NewTicker(wb.window)
+	defer ticker.Stop()
+
+	for {
+		select {
+		case <-ticker.C:
+		case <-wb.full:
+		}
+
+		wb.flush()
+	}
+}
+
+func (wb *writeBehind) flush() {
+
+	wb.mu.Lock()
+	ops := wb.order
+	wb.pending = make(map[string]*writeOp)
+	wb.order = nil
+	wb.mu.Unlock()
+
+	if len(ops) == 0 {
+		return
+	}
+
+	err := REGISTRY.ApplyBatch(ops)
+
+	// a failed batch is retried one write at a time, so one bad write doesn't fail the others
+	if err != nil && len(ops) > 1 {
+
+		METRICS.dbRetries.Add(uint64(len(ops)))
+
+		for _, op := range ops {
+			op.done(REGISTRY.ApplyBatch([]*writeOp{op}))
+		}
+
+		return
+	}
+
+	for _, op := range ops {
+		op.done(err)
+	}
+}
+
+func (op *writeOp) done(err error) {
+
+	for _, waiter := range op.waiters {
+		waiter <- err
+	}
+}